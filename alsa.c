@@ -0,0 +1,192 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "dioxide.h"
+
+/* Direct ALSA PCM output. A thread of our own renders straight into the
+ * device's mmap'd ring buffer, a period at a time, with no SDL in between
+ * and no copies, short of the odd block a period doesn't end on or more
+ * than one channel. Output never pauses; a silent render is only a
+ * memset.
+ *
+ * Any PCM will do, so it can be tried without a sound card against the
+ * null plugin (-D null), or recorded with the file plugin, for instance
+ * -D 'file:"/tmp/dioxide.raw",raw'. */
+
+static snd_pcm_t *pcm;
+static pthread_t thread;
+static atomic_int running;
+
+static void die(const char *what, int retval) {
+    printf("Couldn't %s: %s\n", what, snd_strerror(retval));
+    exit(EXIT_FAILURE);
+}
+
+/* Put the device back on its feet after an underrun or a suspend. */
+static void recover(struct dioxide *d, int retval) {
+    if (retval == -EPIPE) {
+        record_xrun(d);
+    }
+
+    retval = snd_pcm_recover(pcm, retval, 1);
+    if (retval < 0) {
+        die("recover PCM", retval);
+    }
+}
+
+static void* play(void *private) {
+    struct dioxide *d = private;
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames;
+    snd_pcm_sframes_t avail, committed;
+    signed short *buf;
+    unsigned long long then, start;
+    int retval;
+
+    make_realtime(d, "audio", d->rt_cpu);
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) {
+            recover(d, avail);
+            continue;
+        }
+
+        /* The ring is full, so start it if it isn't going yet: at first,
+         * and after every recovery. Committing through mmap doesn't count
+         * towards the start threshold on a hw device. */
+        if (avail < d->period &&
+            snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+            retval = snd_pcm_start(pcm);
+            if (retval < 0) {
+                recover(d, retval);
+            }
+            continue;
+        }
+
+        if (avail < d->period) {
+            retval = snd_pcm_wait(pcm, 1000);
+            if (retval < 0) {
+                recover(d, retval);
+            }
+            continue;
+        }
+
+        frames = d->period;
+        retval = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames);
+        if (retval < 0) {
+            recover(d, retval);
+            continue;
+        }
+
+        /* Interleaved, so the first channel's area is every frame. */
+        buf = (signed short*)((char*)areas[0].addr +
+            (areas[0].first + offset * areas[0].step) / 8);
+
+        /* Events play one period late, as with SDL. */
+        then = event_clock();
+        start = then - 1000000000ULL * frames / d->rate;
+
+        render(d, buf, frames, start);
+
+        record_callback(d, then, frames);
+        trace_span(d, 0, "audio", "callback", frames, then);
+
+        committed = snd_pcm_mmap_commit(pcm, offset, frames);
+        if (committed < 0 || committed != frames) {
+            recover(d, committed < 0 ? committed : -EPIPE);
+        }
+    }
+
+    return NULL;
+}
+
+static void setup_alsa(struct dioxide *d) {
+    snd_pcm_hw_params_t *hw_params;
+    snd_pcm_sw_params_t *sw_params;
+    snd_pcm_uframes_t period_size = d->period_size;
+    const char *device = d->device ? d->device : "default";
+    unsigned rate = d->sample_rate, periods = d->periods;
+    int retval;
+
+    retval = snd_pcm_open(&pcm, device, SND_PCM_STREAM_PLAYBACK, 0);
+    if (retval < 0) {
+        die("open PCM", retval);
+    }
+
+    snd_pcm_hw_params_alloca(&hw_params);
+    snd_pcm_hw_params_any(pcm, hw_params);
+
+    retval = snd_pcm_hw_params_set_access(pcm, hw_params,
+        SND_PCM_ACCESS_MMAP_INTERLEAVED);
+    if (retval < 0) {
+        die("use mmap access", retval);
+    }
+
+    retval = snd_pcm_hw_params_set_format(pcm, hw_params,
+        SND_PCM_FORMAT_S16);
+    if (retval < 0) {
+        die("set 16-bit format", retval);
+    }
+
+    retval = snd_pcm_hw_params_set_channels(pcm, hw_params, d->channels);
+    if (retval < 0) {
+        die("set channels", retval);
+    }
+
+    snd_pcm_hw_params_set_rate_near(pcm, hw_params, &rate, NULL);
+    snd_pcm_hw_params_set_period_size_near(pcm, hw_params, &period_size,
+        NULL);
+    snd_pcm_hw_params_set_periods_near(pcm, hw_params, &periods, NULL);
+
+    retval = snd_pcm_hw_params(pcm, hw_params);
+    if (retval < 0) {
+        die("set hardware parameters", retval);
+    }
+
+    /* Wake up for every period. Plugins that take writes the ordinary way
+     * start once the ring is full; play() starts the rest itself. */
+    snd_pcm_sw_params_alloca(&sw_params);
+    snd_pcm_sw_params_current(pcm, sw_params);
+    snd_pcm_sw_params_set_avail_min(pcm, sw_params, period_size);
+    snd_pcm_sw_params_set_start_threshold(pcm, sw_params,
+        period_size * periods);
+
+    retval = snd_pcm_sw_params(pcm, sw_params);
+    if (retval < 0) {
+        die("set software parameters", retval);
+    }
+
+    printf("Opened %s for playback: Rate %u, %u channels, period %lu samples, "
+        "%u periods\n", device, rate, d->channels, period_size, periods);
+
+    setup_engine(d, rate, d->channels, period_size);
+
+    atomic_store(&running, 1);
+
+    retval = pthread_create(&thread, NULL, play, d);
+    if (retval) {
+        printf("Couldn't start audio thread: %s\n", strerror(retval));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void resume_alsa(struct dioxide *d) {
+}
+
+static void close_alsa(struct dioxide *d) {
+    atomic_store(&running, 0);
+    pthread_join(thread, NULL);
+
+    snd_pcm_drop(pcm);
+    snd_pcm_close(pcm);
+
+    close_engine(d);
+}
+
+struct backend alsa_backend = {
+    "alsa",
+    setup_alsa,
+    resume_alsa,
+    close_alsa,
+};
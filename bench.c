@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dioxide.h"
+
+/* Microbenchmarks for the DSP kernels. Every kernel is timed over whole
+ * buffers until a minimum wall time has passed, and reported as nanoseconds
+ * per output sample and as a multiple of realtime. */
+
+#define RATE 48000
+#define SAMPLES 512
+
+static double min_time = 0.1;
+
+static unsigned polyphonies[] = { 1, 2, 4, 8, 16, 32, 64 };
+static unsigned pitches[] = { 24, 36, 48, 60, 72, 84, 96, 108 };
+static const char *registrations[] = {
+    "008000000",
+    "888000000",
+    "888888888",
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *kernel, unsigned voices, unsigned pitch,
+                   const char *drawbars, double elapsed,
+                   unsigned long samples) {
+    double ns = elapsed * 1e9 / samples;
+
+    printf("%-10s %6u %5u %10s %12.2f %10.1fx\n", kernel, voices, pitch,
+        drawbars, ns, (double)samples / RATE / elapsed);
+}
+
+static void set_drawbars(struct dioxide *d, const char *drawbars) {
+    unsigned i;
+
+    /* Uranium doesn't care; it's passed "-". */
+    if (strlen(drawbars) != 9) {
+        return;
+    }
+
+    for (i = 0; i < 9; i++) {
+        d->drawbars[i] = drawbars[i] - '0';
+    }
+}
+
+static void set_voices(struct dioxide *d, unsigned voices, unsigned pitch) {
+    struct voices *v = &d->voices;
+    unsigned i;
+
+    clear_voices(d);
+
+    /* Every voice on the same key, so that only polyphony varies. Going
+     * around voice_on() leaves the note index stale, which is fine here. */
+    v->count = voices;
+
+    for (i = 0; i < voices; i++) {
+        v->note[i] = pitch;
+        v->phase[i] = 0;
+        v->growl_phase[i] = 0;
+        v->element[i] = d->metal;
+        v->adsr_phase[i] = ADSR_SUSTAIN;
+        v->adsr_volume[i] = 1.0;
+    }
+
+    update_pitch(d);
+}
+
+static void bench_element(struct dioxide *d, const char *name,
+                          struct element *element, unsigned voices,
+                          unsigned pitch, const char *drawbars) {
+    unsigned long samples = 0;
+    double then, elapsed;
+
+    d->metal = element;
+    set_drawbars(d, drawbars);
+    set_voices(d, voices, pitch);
+
+    then = now();
+
+    do {
+        memset(d->front_buffer, 0, SAMPLES * sizeof(float));
+
+        update_envelopes(d);
+
+        if (element->prepare) {
+            element->prepare(d, SAMPLES);
+        }
+
+        element->generate(d, &d->voices, 0, d->voices.count,
+            d->front_buffer, SAMPLES, 0);
+
+        samples += SAMPLES;
+        elapsed = now() - then;
+    } while (elapsed < min_time);
+
+    report(name, voices, pitch, drawbars, elapsed, samples);
+}
+
+static void bench_lfo(struct dioxide *d, unsigned count) {
+    struct lfo lfo = { .rate = 5, .center = 1, .amplitude = 0.5 };
+    unsigned long samples = 0;
+    unsigned i;
+    double then, elapsed;
+    volatile double sink = 0;
+
+    then = now();
+
+    do {
+        /* Step the whole buffer, count samples at a time. */
+        for (i = 0; i < SAMPLES; i += count) {
+            sink += step_lfo(d, &lfo, count);
+        }
+
+        samples += SAMPLES;
+        elapsed = now() - then;
+    } while (elapsed < min_time);
+
+    report(count == 1 ? "lfo/1" : "lfo/block", 1, 0, "-", elapsed, samples);
+}
+
+static void bench_pitch(struct dioxide *d, unsigned voices) {
+    unsigned long samples = 0;
+    double then, elapsed;
+
+    set_voices(d, voices, 60);
+    d->pitch_bend = 1234;
+
+    then = now();
+
+    do {
+        /* Once per buffer, as in render(). */
+        update_pitch(d);
+
+        samples += SAMPLES;
+        elapsed = now() - then;
+    } while (elapsed < min_time);
+
+    report("pitch", voices, 60, "-", elapsed, samples);
+}
+
+/* The built-in chorus, phaser and low-pass filter, fused into one pass over
+ * the buffer or run one after another, as separate plugins would be. */
+static void bench_fx(struct dioxide *d, int fused) {
+    static const unsigned long ids[] = { 2583, 2586, 1672 };
+    const LADSPA_Descriptor *descs[ARRAY_SIZE(ids)];
+    LADSPA_Handle handles[ARRAY_SIZE(ids)];
+    LADSPA_Data controls[ARRAY_SIZE(ids)][8] = {
+        { 0, 10, 5, 1, 1, 0.5, 0.4 },
+        { 0, 0.5, 1, 0.8, 0.5 },
+        { 3000, 1 },
+    };
+    float *buffer = d->front_buffer, saw[SAMPLES];
+    unsigned long samples = 0, j;
+    unsigned i;
+    double then, elapsed;
+
+    for (i = 0; i < SAMPLES; i++) {
+        saw[i] = (i % 100) * 0.02 - 1;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(ids); i++) {
+        descs[i] = native_descriptor(ids[i]);
+        handles[i] = descs[i]->instantiate(descs[i], RATE);
+
+        for (j = 0; j < descs[i]->PortCount; j++) {
+            descs[i]->connect_port(handles[i], j,
+                LADSPA_IS_PORT_AUDIO(descs[i]->PortDescriptors[j]) ?
+                buffer : &controls[i][j]);
+        }
+
+        descs[i]->activate(handles[i]);
+    }
+
+    then = now();
+
+    do {
+        memcpy(buffer, saw, sizeof(saw));
+
+        if (fused) {
+            run_native(handles, ARRAY_SIZE(ids), buffer, buffer, SAMPLES);
+        } else {
+            for (i = 0; i < ARRAY_SIZE(ids); i++) {
+                descs[i]->run(handles[i], SAMPLES);
+            }
+        }
+
+        samples += SAMPLES;
+        elapsed = now() - then;
+    } while (elapsed < min_time);
+
+    for (i = 0; i < ARRAY_SIZE(ids); i++) {
+        descs[i]->cleanup(handles[i]);
+    }
+
+    report(fused ? "fx/fused" : "fx/chain", 1, 0, "-", elapsed, samples);
+}
+
+static void bench_convert(struct dioxide *d) {
+    signed short buf[SAMPLES];
+    unsigned long samples = 0;
+    unsigned i;
+    double then, elapsed;
+
+    for (i = 0; i < SAMPLES; i++) {
+        d->front_buffer[i] = (i % 100) * 0.03 - 1.5;
+    }
+
+    then = now();
+
+    do {
+        convert_samples(d, d->front_buffer, buf, SAMPLES);
+
+        samples += SAMPLES;
+        elapsed = now() - then;
+    } while (elapsed < min_time);
+
+    report("convert", 1, 0, "-", elapsed, samples);
+}
+
+void usage(const char *name) {
+    printf("Usage: %s [-k kernels] [-t seconds]\n", name);
+    printf("  -k NAME  Voice kernels: scalar, sse2 or avx2 (default: best\n");
+    printf("           the CPU supports)\n");
+    printf("  -t SECS  Minimum time to spend on each case (default %.2f)\n",
+        min_time);
+}
+
+int main(int argc, char **argv) {
+    struct dioxide *d = calloc(1, sizeof(struct dioxide));
+    unsigned i, j;
+    int opt;
+
+    if (!d) {
+        exit(EXIT_FAILURE);
+    }
+
+    while ((opt = getopt(argc, argv, "hk:t:")) != -1) {
+        switch (opt) {
+            case 'k':
+                if (!strcmp(optarg, "scalar")) {
+                    d->simd = SIMD_SCALAR;
+                } else if (!strcmp(optarg, "sse2")) {
+                    d->simd = SIMD_SSE2;
+                } else if (!strcmp(optarg, "avx2")) {
+                    d->simd = SIMD_AVX2;
+                } else {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+
+                if (d->simd > detect_simd()) {
+                    printf("This CPU can't run %s kernels\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                min_time = atof(optarg);
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Kernels are timed a whole buffer at a time. */
+    d->block_size = SAMPLES;
+    setup_engine(d, RATE, 1, SAMPLES);
+
+    printf("Rate %d, buffer %d samples, at least %.2f sec per case\n\n",
+        RATE, SAMPLES, min_time);
+    printf("%-10s %6s %5s %10s %12s %11s\n", "kernel", "voices", "note",
+        "drawbars", "ns/sample", "realtime");
+
+    /* Titanium: polyphony against registration, then across the keyboard. */
+    for (i = 0; i < ARRAY_SIZE(registrations); i++) {
+        for (j = 0; j < ARRAY_SIZE(polyphonies); j++) {
+            bench_element(d, "titanium", &titanium, polyphonies[j], 60,
+                registrations[i]);
+        }
+    }
+    for (i = 0; i < ARRAY_SIZE(pitches); i++) {
+        bench_element(d, "titanium", &titanium, 8, pitches[i],
+            registrations[ARRAY_SIZE(registrations) - 1]);
+    }
+
+    /* Uranium: the partial count depends on pitch, so sweep both. */
+    for (j = 0; j < ARRAY_SIZE(polyphonies); j++) {
+        bench_element(d, "uranium", &uranium, polyphonies[j], 60, "-");
+    }
+    for (i = 0; i < ARRAY_SIZE(pitches); i++) {
+        bench_element(d, "uranium", &uranium, 8, pitches[i], "-");
+    }
+
+    bench_lfo(d, 1);
+    bench_lfo(d, SAMPLES);
+
+    for (j = 0; j < ARRAY_SIZE(polyphonies); j++) {
+        bench_pitch(d, polyphonies[j]);
+    }
+
+    bench_fx(d, 0);
+    bench_fx(d, 1);
+
+    bench_convert(d);
+
+    close_engine(d);
+    free(d);
+
+    return EXIT_SUCCESS;
+}
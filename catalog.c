@@ -0,0 +1,525 @@
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "dioxide.h"
+
+/* Every LADSPA plugin installed along LADSPA_PATH, by UniqueID. Describing
+ * a library means dlopen()ing it, which is slow and runs its constructors,
+ * so what's learned is kept in an index file and a library is only opened
+ * again when its mtime or size changes. Otherwise a library is opened only
+ * once one of its plugins is actually selected.
+ *
+ * Built-in effects take the place of installed plugins with the same
+ * UniqueID or label, unless d->prefer_ladspa is set. */
+
+#define CATALOG_BUCKETS 256
+
+#define DEFAULT_LADSPA_PATH \
+    "/usr/local/lib/ladspa:/usr/lib/ladspa:/usr/lib64/ladspa"
+
+struct library {
+    char *path;
+    long long mtime, size;
+
+    /* Found by this scan; libraries that weren't have been removed. */
+    int seen;
+
+    void *dl_handle;
+    LADSPA_Descriptor_Function describe;
+
+    struct library *next;
+};
+
+struct entry {
+    unsigned long id;
+    /* Which of the library's descriptors this is. */
+    unsigned long index;
+    int properties;
+    /* Two letters a port: audio or control, then in or out, such as
+     * "ai,ao,ci". */
+    char *layout;
+    char *label;
+
+    struct library *library;
+    struct entry *next;
+};
+
+struct catalog {
+    struct library *libraries;
+    struct entry *buckets[CATALOG_BUCKETS];
+    unsigned count;
+    int dirty;
+};
+
+static struct library* find_library(struct catalog *c, const char *path) {
+    struct library *library;
+
+    for (library = c->libraries; library; library = library->next) {
+        if (!strcmp(library->path, path)) {
+            return library;
+        }
+    }
+
+    return NULL;
+}
+
+static struct library* add_library(struct catalog *c, const char *path,
+                                   long long mtime, long long size) {
+    struct library *library = calloc(1, sizeof(struct library));
+
+    library->path = strdup(path);
+    library->mtime = mtime;
+    library->size = size;
+
+    library->next = c->libraries;
+    c->libraries = library;
+
+    return library;
+}
+
+static void add_entry(struct catalog *c, struct library *library,
+                      unsigned long id, unsigned long index, int properties,
+                      const char *layout, const char *label) {
+    struct entry *entry = calloc(1, sizeof(struct entry));
+    struct entry **bucket = &c->buckets[id % CATALOG_BUCKETS];
+
+    entry->id = id;
+    entry->index = index;
+    entry->properties = properties;
+    entry->layout = strdup(layout);
+    entry->label = strdup(label);
+    entry->library = library;
+
+    entry->next = *bucket;
+    *bucket = entry;
+
+    c->count++;
+}
+
+static struct entry* find_entry(struct catalog *c, unsigned long id) {
+    struct entry *entry;
+
+    for (entry = c->buckets[id % CATALOG_BUCKETS]; entry;
+        entry = entry->next) {
+        if (entry->id == id) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static void free_entry(struct entry *entry) {
+    free(entry->layout);
+    free(entry->label);
+    free(entry);
+}
+
+/* Forget every plugin from library, so it can be described afresh. */
+static void forget_entries(struct catalog *c, struct library *library) {
+    struct entry **link, *doomed;
+    unsigned i;
+
+    for (i = 0; i < CATALOG_BUCKETS; i++) {
+        link = &c->buckets[i];
+
+        while (*link) {
+            if ((*link)->library == library) {
+                doomed = *link;
+                *link = doomed->next;
+                free_entry(doomed);
+                c->count--;
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+}
+
+static void describe_layout(const LADSPA_Descriptor *desc, char *layout,
+                            size_t size) {
+    LADSPA_PortDescriptor port;
+    unsigned long i;
+    size_t used = 0;
+
+    layout[0] = '\0';
+
+    for (i = 0; i < desc->PortCount && used + 4 < size; i++) {
+        port = desc->PortDescriptors[i];
+
+        used += snprintf(layout + used, size - used, "%s%c%c", i ? "," : "",
+            LADSPA_IS_PORT_AUDIO(port) ? 'a' : 'c',
+            LADSPA_IS_PORT_INPUT(port) ? 'i' : 'o');
+    }
+
+    if (!used) {
+        strcpy(layout, "-");
+    }
+}
+
+/* Open a library just long enough to list its plugins. */
+static void describe_library(struct catalog *c, struct library *library) {
+    LADSPA_Descriptor_Function describe;
+    const LADSPA_Descriptor *desc;
+    char layout[256];
+    void *handle;
+    unsigned long i;
+
+    handle = dlopen(library->path, RTLD_NOW | RTLD_LOCAL);
+
+    if (!handle) {
+        printf("Couldn't load plugin %s: %s\n", library->path, dlerror());
+        return;
+    }
+
+    describe = dlsym(handle, "ladspa_descriptor");
+
+    if (!describe) {
+        printf("Couldn't describe plugin %s: %s\n", library->path,
+            dlerror());
+        dlclose(handle);
+        return;
+    }
+
+    for (i = 0; (desc = describe(i)); i++) {
+        describe_layout(desc, layout, sizeof(layout));
+        add_entry(c, library, desc->UniqueID, i, desc->Properties, layout,
+            desc->Label);
+    }
+
+    dlclose(handle);
+}
+
+static void scan_library(struct catalog *c, const char *path) {
+    struct library *library;
+    struct stat st;
+
+    if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+        return;
+    }
+
+    library = find_library(c, path);
+
+    if (library && library->mtime == st.st_mtime &&
+        library->size == st.st_size) {
+        library->seen = 1;
+        return;
+    }
+
+    if (library) {
+        forget_entries(c, library);
+        library->mtime = st.st_mtime;
+        library->size = st.st_size;
+    } else {
+        library = add_library(c, path, st.st_mtime, st.st_size);
+    }
+
+    library->seen = 1;
+    c->dirty = 1;
+
+    describe_library(c, library);
+}
+
+static void scan_directory(struct catalog *c, const char *dir) {
+    struct dirent *dirent;
+    char path[4096];
+    size_t len;
+    DIR *dirp;
+
+    dirp = opendir(dir);
+    if (!dirp) {
+        return;
+    }
+
+    while ((dirent = readdir(dirp))) {
+        len = strlen(dirent->d_name);
+
+        if (len < 4 || strcmp(dirent->d_name + len - 3, ".so")) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", dir, dirent->d_name);
+        scan_library(c, path);
+    }
+
+    closedir(dirp);
+}
+
+/* Drop libraries that were indexed but have since been removed. */
+static void sweep_libraries(struct catalog *c) {
+    struct library **link = &c->libraries, *doomed;
+
+    while (*link) {
+        if ((*link)->seen) {
+            link = &(*link)->next;
+            continue;
+        }
+
+        doomed = *link;
+        *link = doomed->next;
+
+        forget_entries(c, doomed);
+        free(doomed->path);
+        free(doomed);
+
+        c->dirty = 1;
+    }
+}
+
+/* The index is plain text, a line per library followed by a line per
+ * plugin in it:
+ *
+ *   L <mtime> <size> <path>
+ *   P <id> <index> <properties> <layout> <label>
+ */
+static void read_index(struct catalog *c, const char *path) {
+    struct library *library = NULL;
+    unsigned long id, index;
+    long long mtime, size;
+    char line[4352], layout[256];
+    int properties, offset;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        c->dirty = 1;
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (sscanf(line, "L %lld %lld %n", &mtime, &size, &offset) == 2) {
+            library = add_library(c, line + offset, mtime, size);
+        } else if (library && sscanf(line, "P %lu %lu %d %255s %n", &id,
+            &index, &properties, layout, &offset) == 4) {
+            add_entry(c, library, id, index, properties, layout,
+                line + offset);
+        }
+    }
+
+    fclose(f);
+}
+
+static int write_index(struct catalog *c, const char *path) {
+    struct library *library;
+    struct entry *entry;
+    char temp[4096];
+    unsigned i;
+    FILE *f;
+
+    /* Written aside and renamed, so a reader never sees half of it. */
+    if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp)) {
+        return -1;
+    }
+
+    f = fopen(temp, "w");
+    if (!f) {
+        return -1;
+    }
+
+    for (library = c->libraries; library; library = library->next) {
+        fprintf(f, "L %lld %lld %s\n", library->mtime, library->size,
+            library->path);
+
+        for (i = 0; i < CATALOG_BUCKETS; i++) {
+            for (entry = c->buckets[i]; entry; entry = entry->next) {
+                if (entry->library == library) {
+                    fprintf(f, "P %lu %lu %d %s %s\n", entry->id,
+                        entry->index, entry->properties, entry->layout,
+                        entry->label);
+                }
+            }
+        }
+    }
+
+    if (fclose(f)) {
+        return -1;
+    }
+
+    return rename(temp, path);
+}
+
+/* $XDG_CACHE_HOME/dioxide-ladspa.index, or under ~/.cache. */
+static int index_path(char *path, size_t size) {
+    const char *cache = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    char dir[4096];
+
+    if (cache && *cache) {
+        snprintf(dir, sizeof(dir), "%s", cache);
+    } else if (home && *home) {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return -1;
+    }
+
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        return -1;
+    }
+
+    /* Too long a path to hold is as good as none. */
+    if (snprintf(path, size, "%s/dioxide-ladspa.index", dir) >= (int)size) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void setup_catalog(struct dioxide *d) {
+    struct catalog *c = calloc(1, sizeof(struct catalog));
+    const char *ladspa_path = getenv("LADSPA_PATH");
+    char *dirs, *dir, *saveptr = NULL, index[4096];
+    int indexed;
+
+    if (!ladspa_path || !*ladspa_path) {
+        ladspa_path = DEFAULT_LADSPA_PATH;
+    }
+
+    indexed = !index_path(index, sizeof(index));
+
+    if (indexed) {
+        read_index(c, index);
+    }
+
+    dirs = strdup(ladspa_path);
+    for (dir = strtok_r(dirs, ":", &saveptr); dir;
+        dir = strtok_r(NULL, ":", &saveptr)) {
+        scan_directory(c, dir);
+    }
+    free(dirs);
+
+    sweep_libraries(c);
+
+    if (indexed && c->dirty && write_index(c, index)) {
+        printf("Couldn't write plugin index %s\n", index);
+    }
+
+    printf("Found %u LADSPA plugins%s\n", c->count,
+        c->dirty ? "" : " (indexed)");
+
+    d->catalog = c;
+}
+
+/* The descriptor for a plugin, opening its library if this is the first
+ * plugin from it to be used. */
+const LADSPA_Descriptor* load_descriptor(struct dioxide *d,
+                                         unsigned long id) {
+    const LADSPA_Descriptor *desc = native_descriptor(id);
+    struct entry *entry = find_entry(d->catalog, id);
+    struct library *library;
+
+    if (!entry || (desc && !d->prefer_ladspa)) {
+        return desc;
+    }
+
+    library = entry->library;
+
+    if (!library->dl_handle) {
+        library->dl_handle = dlopen(library->path, RTLD_NOW | RTLD_LOCAL);
+
+        if (!library->dl_handle) {
+            printf("Couldn't load plugin %s: %s\n", library->path,
+                dlerror());
+            return NULL;
+        }
+
+        library->describe = dlsym(library->dl_handle, "ladspa_descriptor");
+    }
+
+    if (!library->describe) {
+        return NULL;
+    }
+
+    desc = library->describe(entry->index);
+
+    /* Stale, if the library was replaced while we were running. */
+    if (!desc || desc->UniqueID != id) {
+        printf("Plugin %lu moved within %s; rescan to find it\n", id,
+            library->path);
+        return NULL;
+    }
+
+    return desc;
+}
+
+/* The UniqueID of a plugin with this label, or zero if there's none. */
+unsigned long find_label(struct dioxide *d, const char *label) {
+    unsigned long id = find_native_label(label);
+    struct catalog *c = d->catalog;
+    struct entry *entry;
+    unsigned i;
+
+    if (id && !d->prefer_ladspa) {
+        return id;
+    }
+
+    for (i = 0; i < CATALOG_BUCKETS; i++) {
+        for (entry = c->buckets[i]; entry; entry = entry->next) {
+            if (!strcmp(entry->label, label)) {
+                return entry->id;
+            }
+        }
+    }
+
+    return id;
+}
+
+void list_catalog(struct dioxide *d, FILE *f) {
+    const LADSPA_Descriptor *desc;
+    struct catalog *c = d->catalog;
+    struct entry *entry;
+    char layout[256];
+    unsigned i;
+
+    for (i = 0; (desc = native_at(i)); i++) {
+        describe_layout(desc, layout, sizeof(layout));
+        fprintf(f, "%6lu %-24s %-28s %s\n", desc->UniqueID, desc->Label,
+            layout, "(built in)");
+    }
+
+    for (i = 0; i < CATALOG_BUCKETS; i++) {
+        for (entry = c->buckets[i]; entry; entry = entry->next) {
+            fprintf(f, "%6lu %-24s %-28s %s\n", entry->id, entry->label,
+                entry->layout, entry->library->path);
+        }
+    }
+}
+
+/* After every instance from the catalog has been cleaned up. */
+void cleanup_catalog(struct dioxide *d) {
+    struct catalog *c = d->catalog;
+    struct library *library, *doomed;
+    struct entry *entry, *next;
+    unsigned i;
+
+    if (!c) {
+        return;
+    }
+
+    for (i = 0; i < CATALOG_BUCKETS; i++) {
+        for (entry = c->buckets[i]; entry; entry = next) {
+            next = entry->next;
+            free_entry(entry);
+        }
+    }
+
+    library = c->libraries;
+    while (library) {
+        doomed = library;
+        library = library->next;
+
+        if (doomed->dl_handle) {
+            dlclose(doomed->dl_handle);
+        }
+
+        free(doomed->path);
+        free(doomed);
+    }
+
+    free(c);
+    d->catalog = NULL;
+}
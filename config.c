@@ -0,0 +1,175 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "dioxide.h"
+
+/* Audio settings, from the command line or a config file. The file holds
+ * lines of "name = value", with # starting a comment; anything given on
+ * the command line wins over it, and anything given nowhere gets its
+ * default. By default the file is $XDG_CONFIG_HOME/dioxide.conf, or under
+ * ~/.config, and needn't exist. */
+
+struct setting {
+    const char *name;
+    size_t offset;
+    unsigned min, max, fallback;
+};
+
+static const struct setting settings[] = {
+    { "rate", offsetof(struct dioxide, sample_rate), 8000, 192000, 48000 },
+    { "channels", offsetof(struct dioxide, channels), 1, MAX_CHANNELS, 1 },
+    { "period", offsetof(struct dioxide, period_size), 16, 16384, 512 },
+    { "periods", offsetof(struct dioxide, periods), 2, 64, 2 },
+    { "block", offsetof(struct dioxide, block_size), 16, 4096, 64 },
+    { NULL },
+};
+
+static unsigned* field(struct dioxide *d, const struct setting *s) {
+    return (unsigned*)((char*)d + s->offset);
+}
+
+static const struct setting* find_setting(const char *name) {
+    const struct setting *s;
+
+    for (s = settings; s->name; s++) {
+        if (!strcmp(s->name, name)) {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+/* Set name to value, or say why not and return -1. */
+int set_setting(struct dioxide *d, const char *name, const char *value) {
+    const struct setting *s = find_setting(name);
+    unsigned long n;
+    char *end;
+
+    if (!s) {
+        printf("Unknown setting %s\n", name);
+        return -1;
+    }
+
+    errno = 0;
+    n = strtoul(value, &end, 0);
+    if (errno || end == value || *end || n < s->min || n > s->max) {
+        printf("Bad %s %s; it should be %u to %u\n", name, value, s->min,
+            s->max);
+        return -1;
+    }
+
+    *field(d, s) = n;
+
+    return 0;
+}
+
+static char* trim(char *s) {
+    char *end;
+
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    *end = '\0';
+
+    return s;
+}
+
+static int default_path(char *path, size_t size) {
+    const char *config = getenv("XDG_CONFIG_HOME"), *home = getenv("HOME");
+
+    if (config && *config) {
+        snprintf(path, size, "%s/dioxide.conf", config);
+    } else if (home && *home) {
+        snprintf(path, size, "%s/.config/dioxide.conf", home);
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Fill in whatever wasn't set on the command line from path, or from the
+ * default file if path is NULL. Returns -1 on a bad line. */
+int load_config(struct dioxide *d, const char *path) {
+    const struct setting *s;
+    char buf[4096], line[256], *name, *value, *hash;
+    unsigned number = 0;
+    FILE *f;
+    int retval = 0;
+
+    if (!path) {
+        if (default_path(buf, sizeof(buf))) {
+            return 0;
+        }
+
+        f = fopen(buf, "r");
+        if (!f) {
+            return 0;
+        }
+        path = buf;
+    } else {
+        f = fopen(path, "r");
+        if (!f) {
+            printf("Couldn't open config file %s: %s\n", path,
+                strerror(errno));
+            return -1;
+        }
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        number++;
+
+        if ((hash = strchr(line, '#'))) {
+            *hash = '\0';
+        }
+
+        name = trim(line);
+        if (!*name) {
+            continue;
+        }
+
+        value = strchr(name, '=');
+        if (!value) {
+            printf("%s:%u: Expected \"name = value\"\n", path, number);
+            retval = -1;
+            break;
+        }
+        *value++ = '\0';
+        name = trim(name);
+        value = trim(value);
+
+        s = find_setting(name);
+        if (s && *field(d, s)) {
+            continue;
+        }
+
+        if (set_setting(d, name, value)) {
+            printf("  in %s, line %u\n", path, number);
+            retval = -1;
+            break;
+        }
+    }
+
+    fclose(f);
+
+    return retval;
+}
+
+/* Everything still unset gets its default. */
+void default_settings(struct dioxide *d) {
+    const struct setting *s;
+
+    for (s = settings; s->name; s++) {
+        if (!*field(d, s)) {
+            *field(d, s) = s->fallback;
+        }
+    }
+}
@@ -1,12 +1,13 @@
+#include <stdatomic.h>
+
 #include <asoundlib.h>
 
 #include <ladspa.h>
 
-#include "SDL.h"
-#include "SDL_audio.h"
+#include "osc.h"
 
 struct lfo {
-    double phase;
+    uint32_t phase;
 
     double rate;
     double center;
@@ -14,12 +15,17 @@ struct lfo {
 };
 
 struct ladspa_plugin {
-    void *dl_handle;
-
     unsigned input, output;
 
     const LADSPA_Descriptor *desc;
     LADSPA_Handle handle;
+    /* Every control port's own value, and where each is connected: to
+     * its own value, or to a knob. */
+    LADSPA_Data *controls;
+    LADSPA_Data **ports;
+    /* A block for each audio port besides input and output, held at its
+     * control's value if it's an input. */
+    LADSPA_Data **signals;
     struct ladspa_plugin *next;
 };
 
@@ -43,74 +49,433 @@ static double step_up = 1.0594630943592953;
 static double step_down = 0.94387431268169353;
 
 struct dioxide;
+struct workers;
+struct pipeline;
+struct trace;
+struct catalog;
+struct effects;
+
+/* A sequencer event, boiled down to what the audio thread needs. time is
+ * when it arrived, in nanoseconds on the event clock; type is one of the
+ * SND_SEQ_EVENT_* values; param is a note or controller number and value a
+ * controller value, program, or pitch bend. */
+struct event {
+    unsigned long long time;
+    unsigned char type;
+    unsigned char param;
+    signed short value;
+};
 
-struct note {
-    unsigned note;
-    float pitch;
-    double phase;
+/* Must be a power of two. */
+#define EVENT_QUEUE_SIZE 1024
+
+struct event_queue {
+    /* Kept on separate cache lines, so the two threads don't fight. */
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
 
-    enum adsr adsr_phase;
-    float adsr_volume;
+    /* Only touched by the producer. */
+    unsigned dropped;
 
-    struct note *next;
+    struct event events[EVENT_QUEUE_SIZE];
+};
+
+enum simd {
+    SIMD_AUTO,
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+};
+
+/* One voice per MIDI note is all a keyboard can ask for. */
+#define MAX_VOICES 128
+#define MAX_THREADS 16
+
+#define MAX_CONTROLLERS 8
+/* Output is mono, copied to every channel of the device. */
+#define MAX_CHANNELS 8
+
+/* One trace ring for the audio thread and each worker, by thread index,
+ * one for the sequencer thread, and one for the pipeline's effects thread. */
+#define TRACE_SEQUENCER (MAX_THREADS + 1)
+#define TRACE_EFFECTS (MAX_THREADS + 2)
+#define TRACE_RINGS (MAX_THREADS + 3)
+#define MIDI_NOTES 128
+/* The widest SIMD group; voice arrays are padded to a multiple of it, so a
+ * kernel may always load a whole group. */
+#define VOICE_LANES 8
+
+/* Voice state, structure-of-arrays style. Live voices are packed at the
+ * front, in no particular order. The pool is sized once, at startup; past
+ * that, notes only ever move voices around. */
+struct voices {
+    unsigned count, capacity;
+
+    /* Which voice is playing each MIDI note, or -1. */
+    short index[MIDI_NOTES];
+
+    unsigned *note;
+    float *pitch;
+    uint32_t *phase;
+    uint32_t *growl_phase;
+
+    /* The element each voice was started with. */
+    struct element **element;
+    enum adsr *adsr_phase;
+    float *adsr_volume;
 };
 
 struct element {
-    void (*generate)(struct dioxide *d, struct note *note, float *buffer, unsigned count);
-    void (*adsr)(struct dioxide *d, struct note *note);
+    const char *name;
+    /* Called once per buffer before any voices are generated; optional. */
+    void (*prepare)(struct dioxide *d, unsigned count);
+    /* Adds the voices from first up to last that are bound to this
+     * element into buffer, using thread's scratch. first is a multiple of
+     * VOICE_LANES; may run on several threads at once. */
+    void (*generate)(struct dioxide *d, struct voices *v, unsigned first,
+                     unsigned last, float *buffer, unsigned count,
+                     unsigned thread);
+    /* Rough relative cost of rendering one voice, for load balancing. */
+    float (*cost)(struct dioxide *d, struct voices *v, unsigned voice);
+    /* Envelope shape: attack to peak, decay to sustain. */
+    float peak;
+    float sustain;
+    /* Time spent in prepare() and generate(), on all threads. */
+    atomic_ullong render_ns;
+};
+
+/* Log2 buckets of callback duration against the buffer's length in time:
+ * bucket 0 is under 1/1024 of it, bucket 11 is from 1x up to 2x, and the
+ * last bucket takes everything from 16x. */
+#define METRIC_BUCKETS 16
+#define METRIC_UNITY 11
+
+/* Written by the audio thread, read by anyone, without locks. */
+struct metrics {
+    atomic_ulong callbacks;
+    /* Callbacks that took longer than their buffer lasts. */
+    atomic_ulong misses;
+    atomic_ulong xruns;
+    atomic_ulong buckets[METRIC_BUCKETS];
+    atomic_ullong worst_ns;
+    atomic_ullong total_ns;
+    /* Time spent in the plugin chain. */
+    atomic_ullong effects_ns;
+    atomic_uint peak_polyphony;
+};
+
+/* What the effects and the final mix read. Events set d->knobs, and the
+ * effects read their own copy, taken as each block is handed to them, so
+ * that with the pipeline the two threads never share one. */
+struct knobs {
+    double volume;
+
+    float chorus_delay;
+
+    float phaser_rate;
+    float phaser_depth;
+    float phaser_spread;
+    float phaser_feedback;
+
+    float lpf_cutoff;
+    float lpf_resonance;
+};
+
+/* Somewhere to send sound. setup() opens the device and sets up the engine
+ * to match it; resume() restarts output, if it was paused for silence,
+ * once a note arrives; close() closes the device and the engine. */
+struct backend {
+    const char *name;
+    void (*setup)(struct dioxide *d);
+    void (*resume)(struct dioxide *d);
+    void (*close)(struct dioxide *d);
 };
 
 struct dioxide {
     snd_seq_t *seq;
     int seq_port;
+    /* Ports subscribed to, and what to subscribe to: controllers whose
+     * client names contain any of these. */
     int connected;
-
-    struct SDL_AudioSpec spec;
+    const char *controllers[MAX_CONTROLLERS];
+    unsigned controller_count;
+
+    /* Sound output, and what was asked of it; zero for the defaults. */
+    struct backend *backend;
+    const char *device;
+    unsigned sample_rate;
+    unsigned channels;
+    unsigned period_size;
+    unsigned periods;
+    unsigned block_size;
+
+    /* What the engine was set up for: sample rate, the device's period, and
+     * the fixed block every period is rendered in, whatever its size. */
+    unsigned rate;
+    unsigned period;
+    unsigned samples;
     float inverse_sample_rate;
+    /* The last block, when the period didn't take all of it: the block,
+     * how much of it is still to be played, and its voices. */
+    signed short *carry;
+    unsigned carried;
+    unsigned carry_polyphony;
 
-    double volume;
     double phase;
 
-    struct note *notes;
+    /* Sequencer thread to audio thread. Everything below it is owned by
+     * the audio thread once audio is running. */
+    struct event_queue events;
+
+    struct metrics metrics;
+    /* NULL unless tracing. */
+    struct trace *trace;
+
+    enum simd simd;
+    /* SCHED_FIFO priority for rendering threads; zero for none of the
+     * realtime setup. The CPU to pin the audio thread to, or -1. */
+    int rt_priority;
+    int rt_cpu;
+
+    /* Worker threads rendering voices alongside the audio thread. */
+    unsigned threads;
+    struct workers *workers;
+    /* Whether effects run a block behind the voices, on a thread of their
+     * own; and that thread. */
+    int pipelined;
+    struct pipeline *pipeline;
+    /* Size of the voice pool; zero means MAX_VOICES. */
+    unsigned max_voices;
+    struct voices voices;
 
     enum wheel_config pitch_wheel_config;
     signed short pitch_bend;
+    /* The wheel's position in semitones, updated once per buffer. */
+    double bend;
 
-    float *front_buffer, *back_buffer;
-
-    float chorus_delay;
-
-    float phaser_rate;
-    float phaser_depth;
-    float phaser_spread;
-    float phaser_feedback;
+    float *front_buffer;
+    /* Scratch for crossfading between two effects graphs. */
+    float *dry_buffer;
+    float *fade_buffer;
 
-    float lpf_cutoff;
-    float lpf_resonance;
+    struct knobs knobs;
+    struct knobs effects_knobs;
 
     float attack_time;
     float decay_time;
     float release_time;
+    /* Per-sample envelope increments, updated once per block. */
+    float attack_step;
+    float decay_step;
+    float release_step;
 
     short drawbars[9];
 
-    struct ladspa_plugin *available_plugins;
-    struct ladspa_plugin *plugin_chain;
+    /* Installed plugins, whether they win over built-ins of the same ID,
+     * and the effects graph as given. */
+    struct catalog *catalog;
+    int prefer_ladspa;
+    const char *effects_graph;
+    /* The audio thread's graph, and the one it is fading out of. */
+    struct effects *effects;
+    struct effects *fading;
+    unsigned fade;
+    /* Graphs on their way into and out of the audio thread. */
+    _Atomic(struct effects*) next_effects;
+    _Atomic(struct effects*) retired_effects;
 
     struct element *metal;
 };
 
 double step_lfo(struct dioxide *d, struct lfo *lfo, unsigned count);
 
+void setup_catalog(struct dioxide *d);
+const LADSPA_Descriptor* load_descriptor(struct dioxide *d, unsigned long id);
+unsigned long find_label(struct dioxide *d, const char *label);
+void list_catalog(struct dioxide *d, FILE *f);
+void cleanup_catalog(struct dioxide *d);
+
+const LADSPA_Descriptor* native_descriptor(unsigned long id);
+unsigned long find_native_label(const char *label);
+const LADSPA_Descriptor* native_at(unsigned i);
+int is_native(const LADSPA_Descriptor *desc);
+void reset_native(LADSPA_Handle handle);
+void run_native(LADSPA_Handle *handles, unsigned count, const float *in,
+                float *out, unsigned long len);
+
+/* Chorus, phaser and low-pass filter, one after another; built in, unless
+ * the installed plugins are preferred. */
+#define DEFAULT_EFFECTS "2583 > 2586 > 1672"
+
+struct effects* compile_effects(struct dioxide *d, const char *graph);
+struct ladspa_plugin* effects_plugins(struct effects *e);
+void describe_effects(struct effects *e, FILE *f);
+float* run_effects(struct dioxide *d, unsigned len, unsigned thread);
+void settle_effects(struct dioxide *d);
+void publish_effects(struct dioxide *d, struct effects *e);
+void reap_effects(struct dioxide *d);
+int swap_effects(struct dioxide *d, const char *graph);
+int effects_ringing(struct dioxide *d);
+void cleanup_effects(struct dioxide *d);
+void free_effects(struct effects *e);
+
+struct ladspa_plugin* select_plugin(struct dioxide *d, unsigned id);
+void release_plugin(struct ladspa_plugin *plugin);
 void setup_plugins(struct dioxide *d);
-void hook_plugins(struct dioxide *d);
+void connect_control(struct ladspa_plugin *plugin, unsigned long port,
+                     LADSPA_Data *data);
+void fill_signals(struct ladspa_plugin *plugin, unsigned len);
+void hook_plugin(struct dioxide *d, struct ladspa_plugin *plugin);
+int plugin_is_neutral(struct dioxide *d, struct ladspa_plugin *plugin);
 void cleanup_plugins(struct dioxide *d);
 
 struct ladspa_plugin* find_plugin_by_id(struct ladspa_plugin *plugin,
                                         unsigned id);
 
+void setup_voices(struct dioxide *d);
+void cleanup_voices(struct dioxide *d);
+void clear_voices(struct dioxide *d);
+void voice_on(struct dioxide *d, unsigned note);
+void voice_off(struct dioxide *d, unsigned note);
+void reap_voices(struct dioxide *d);
+enum simd detect_simd(void);
+const char* simd_name(enum simd simd);
+
+void update_envelopes(struct dioxide *d);
+unsigned step_envelope(struct dioxide *d, struct voices *v, unsigned voice,
+                       float *gains, unsigned stride, unsigned count);
+
+void setup_realtime(struct dioxide *d);
+void lock_memory(struct dioxide *d);
+void make_realtime(struct dioxide *d, const char *name, int cpu);
+
+static inline void relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+unsigned long long event_clock(void);
+
+/* How long a waiting thread spins before it sleeps or yields. Timed rather
+ * than counted, since a pause costs anywhere from 10 to 140 cycles
+ * depending on the CPU. */
+#define SPIN_NS 50000
+
+struct spin {
+    unsigned count;
+    int expired;
+    unsigned long long until;
+};
+
+static inline void start_spin(struct spin *s) {
+    s->count = 0;
+    s->expired = 0;
+    s->until = 0;
+}
+
+/* Pause once and return nonzero while a wait begun with start_spin() has
+ * spun for less than SPIN_NS; the clock is only read every 64 calls. */
+static inline int spinning(struct spin *s) {
+    unsigned long long now;
+
+    if (s->expired) {
+        return 0;
+    }
+
+    if (!(s->count++ & 63)) {
+        now = event_clock();
+
+        if (!s->until) {
+            s->until = now + SPIN_NS;
+        } else if (now >= s->until) {
+            s->expired = 1;
+            return 0;
+        }
+    }
+
+    relax();
+
+    return 1;
+}
+
+void futex_wait(atomic_uint *word, unsigned value);
+void futex_wake(atomic_uint *word);
+
+typedef void (*task_fn)(struct dioxide *d, void *data, unsigned index,
+                        unsigned len, unsigned thread);
+
+void setup_workers(struct dioxide *d);
+void cleanup_workers(struct dioxide *d);
+void render_voices(struct dioxide *d, float *buffer, unsigned len);
+void run_tasks(struct dioxide *d, task_fn task, void *data, unsigned count,
+               unsigned len);
+
+void record_callback(struct dioxide *d, unsigned long long start,
+                     unsigned len);
+void record_xrun(struct dioxide *d);
+void record_polyphony(struct dioxide *d, unsigned polyphony);
+void dump_metrics(struct dioxide *d, FILE *f);
+int write_metrics(struct dioxide *d, const char *path);
+
+void setup_trace(struct dioxide *d, const char *path);
+void cleanup_trace(struct dioxide *d);
+unsigned long long trace_clock(struct dioxide *d);
+void trace_span(struct dioxide *d, unsigned ring, const char *category,
+                const char *name, int arg, unsigned long long start);
+
+void setup_engine(struct dioxide *d, unsigned rate, unsigned channels,
+                  unsigned period);
+void close_engine(struct dioxide *d);
+void update_pitch(struct dioxide *d);
+void generate_voices(struct dioxide *d, unsigned first, unsigned last,
+                     float *buffer, unsigned len, unsigned thread);
+void convert_samples(struct dioxide *d, float *samples, signed short *buf,
+                     unsigned len);
+void finish_block(struct dioxide *d, signed short *buf, unsigned len,
+                  unsigned polyphony, unsigned thread);
+unsigned render_voices_only(struct dioxide *d, float *dry, unsigned len,
+                            unsigned long long time);
+unsigned render(struct dioxide *d, signed short *buf, unsigned len,
+                unsigned long long time);
+int render_ringing(struct dioxide *d);
+void apply_oldest_event(struct dioxide *d);
+
+void setup_pipeline(struct dioxide *d);
+void cleanup_pipeline(struct dioxide *d);
+unsigned render_pipelined(struct dioxide *d, signed short *buf, unsigned len,
+                          unsigned long long time);
+int pipeline_ringing(struct dioxide *d);
+
+void setup_queue(struct event_queue *q);
+int queue_push(struct event_queue *q, const struct event *event);
+int queue_peek(struct event_queue *q, struct event *event);
+int queue_pop(struct event_queue *q, struct event *event);
+int queue_pending(struct event_queue *q);
+int queue_full(struct event_queue *q);
+
 void setup_sequencer(struct dioxide *d);
+void apply_event(struct dioxide *d, struct event *event);
+void handle_event(struct dioxide *d, snd_seq_event_t *event,
+                  unsigned long long time);
 void poll_sequencer(struct dioxide *d);
+void connect_port(struct dioxide *d, int client, int port);
 void solicit_connections(struct dioxide *d);
 
-struct element uranium, titanium;
+int set_setting(struct dioxide *d, const char *name, const char *value);
+int load_config(struct dioxide *d, const char *path);
+void default_settings(struct dioxide *d);
+
+int render_offline(struct dioxide *d, const char *midi_path,
+                   const char *wav_path);
+
+void setup_titanium(struct dioxide *d);
+void cleanup_titanium(struct dioxide *d);
+void setup_uranium(struct dioxide *d);
+void cleanup_uranium(struct dioxide *d);
+
+extern struct element uranium, titanium;
+/* Every element, ending with NULL. */
+extern struct element *elements[];
+
+extern struct backend sdl_backend, alsa_backend;
@@ -0,0 +1,907 @@
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dioxide.h"
+
+/* The effects graph, compiled once into a plan that the audio thread only
+ * has to walk. A graph is written like
+ *
+ *   2583 > 2586 > 1672
+ *   (dry | ChorusI*0.5 | PhaserI*0.5) > 1672
+ *
+ * where a number is a LADSPA UniqueID, a word is a plugin label, ">" feeds
+ * one thing into the next, and a parenthesized group feeds the same signal
+ * to every branch and mixes what comes out, each branch scaled by its
+ * optional "*gain". "dry" passes its input through untouched. A plugin may
+ * be followed by control port values, as in "ChorusI[2=10, 6=0.2]", which
+ * take the place of any knob the port would otherwise follow.
+ *
+ * Every signal gets a buffer by liveness: a plugin runs in place when its
+ * input isn't read by anything else afterwards, and buffers are reused once
+ * their last reader has run. Plugin ports are connected to their buffers
+ * here, once. The branches of a top level group are independent lanes of
+ * one stage, and with worker threads they run side by side. Built-in
+ * effects running in place one after another are fused into one step,
+ * which makes a single pass over the buffer.
+ *
+ * Graphs are swapped while audio runs, RCU style: a new plan is compiled
+ * and activated on the control thread and published through a pointer;
+ * the audio thread picks it up between blocks and crossfades from the old
+ * one, and only once the old one has rendered its last block does it hand
+ * it back to be deactivated and freed, off the audio thread. When the
+ * render is pipelined, the effects thread plays the audio thread's part.
+ *
+ * Plugins are skipped when they provably do nothing: while their controls
+ * are at neutral values, or once their input has been silent long enough
+ * for their output to have died away too. Until then, tails keep ringing
+ * after the last voice has stopped. */
+
+#define MAX_STEPS 64
+#define MAX_BUFFERS 32
+#define MAX_BRANCHES 8
+#define MAX_FUSED 8
+
+/* Length of the crossfade between graphs. */
+#define FADE_MSEC 20
+
+/* How long a plugin's input and output must both stay silent before it is
+ * put to sleep; longer than any delay line it might still be holding. */
+#define TAIL_MSEC 250
+
+/* The quietest volume that silence is judged at, -40 dB: turned all the
+ * way down, the threshold would otherwise be infinite, and every tail
+ * would be cut short by the time the volume came back up. */
+#define QUIET_VOLUME 0.01
+
+/* Buffer 0 is always d->front_buffer, the dry voices. */
+#define DRY 0
+
+enum step_type {
+    STEP_RUN,
+    STEP_MIX,
+};
+
+struct step {
+    enum step_type type;
+    /* Run plugins, one after another, from buffer a into out, or mix gain_a
+     * of a with gain_b of b into out; out may be either of them. Only
+     * built-ins are ever fused, so there is more than one plugin only if
+     * native is set. */
+    struct ladspa_plugin *plugins[MAX_FUSED];
+    unsigned count;
+    int native;
+    unsigned a, b, out;
+    float gain_a, gain_b;
+
+    /* Samples of silence in and out so far, and whether the plugin has
+     * been put to sleep for it. A fresh plugin has no tail. */
+    unsigned quiet;
+    int asleep;
+    /* Which of the plugins were skipped as neutral last block, by bit. */
+    unsigned bypassed;
+};
+
+/* Steps first up to first + count, run in order. */
+struct lane {
+    unsigned first, count;
+};
+
+/* Lanes first up to first + count, any of which may run concurrently. */
+struct stage {
+    unsigned first, count;
+};
+
+struct effects {
+    struct ladspa_plugin *plugins;
+
+    struct step steps[MAX_STEPS];
+    unsigned step_count;
+    struct lane lanes[MAX_STEPS];
+    unsigned lane_count;
+    struct stage stages[MAX_STEPS];
+    unsigned stage_count;
+
+    float *buffers[MAX_BUFFERS];
+    unsigned buffer_count;
+    /* Where the wet signal ends up. */
+    unsigned out;
+
+    /* The stage whose lanes are out on the workers. */
+    struct stage *running;
+    /* Loudest sample that still counts as silence, for this block. */
+    float silence;
+};
+
+struct compiler {
+    struct dioxide *d;
+    struct effects *e;
+
+    const char *graph, *p;
+    int failed;
+
+    /* Readers left for each buffer. A buffer freed while compiling the
+     * lanes of a stage stays busy until the stage ends, since another lane
+     * might still be using it when it would otherwise be reused. */
+    unsigned refs[MAX_BUFFERS];
+    int busy[MAX_BUFFERS];
+    int concurrent;
+
+    /* The lane that steps are being added to, or -1 for a new one. */
+    int lane;
+};
+
+static void fail(struct compiler *c, const char *why) {
+    if (!c->failed) {
+        printf("Couldn't compile effects graph: %s at \"%s\"\n", why, c->p);
+    }
+
+    c->failed = 1;
+}
+
+static unsigned take_buffer(struct compiler *c) {
+    struct effects *e = c->e;
+    unsigned i;
+
+    for (i = DRY + 1; i < e->buffer_count; i++) {
+        if (!c->refs[i] && !c->busy[i]) {
+            c->refs[i] = 1;
+            return i;
+        }
+    }
+
+    if (e->buffer_count == MAX_BUFFERS) {
+        fail(c, "too many buffers");
+        return DRY;
+    }
+
+    if (posix_memalign((void**)&e->buffers[i], 32,
+            c->d->samples * sizeof(float))) {
+        printf("Couldn't allocate effects buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(e->buffers[i], 0, c->d->samples * sizeof(float));
+
+    e->buffer_count++;
+    c->refs[i] = 1;
+
+    return i;
+}
+
+static void release_buffer(struct compiler *c, unsigned buffer) {
+    if (c->refs[buffer] && !--c->refs[buffer] && c->concurrent) {
+        c->busy[buffer] = 1;
+    }
+}
+
+static struct stage* add_stage(struct compiler *c) {
+    struct effects *e = c->e;
+    struct stage *stage;
+
+    if (e->stage_count == MAX_STEPS) {
+        fail(c, "too many stages");
+        return NULL;
+    }
+
+    stage = &e->stages[e->stage_count++];
+    stage->first = e->lane_count;
+    stage->count = 0;
+
+    return stage;
+}
+
+/* Start a new lane in stage, and add steps to it from now on. */
+static int add_lane(struct compiler *c, struct stage *stage) {
+    struct effects *e = c->e;
+
+    if (e->lane_count == MAX_STEPS) {
+        fail(c, "too many lanes");
+        return -1;
+    }
+
+    c->lane = e->lane_count++;
+    e->lanes[c->lane].first = e->step_count;
+    e->lanes[c->lane].count = 0;
+    stage->count++;
+
+    return 0;
+}
+
+/* Whether step can be folded into last, the step before it in its lane. */
+static int can_fuse(struct step *last, struct step *step) {
+    return last->type == STEP_RUN && step->type == STEP_RUN &&
+        last->native && step->native && last->count < MAX_FUSED &&
+        last->out == step->a && step->a == step->out;
+}
+
+static void add_step(struct compiler *c, struct step *step) {
+    struct effects *e = c->e;
+    struct stage *stage;
+    struct step *last;
+
+    /* Steps of the current lane are the last ones added. */
+    if (c->lane >= 0 && e->lanes[c->lane].count) {
+        last = &e->steps[e->step_count - 1];
+
+        if (can_fuse(last, step)) {
+            last->plugins[last->count++] = step->plugins[0];
+            return;
+        }
+    }
+
+    if (e->step_count == MAX_STEPS) {
+        fail(c, "too many steps");
+        return;
+    }
+
+    /* Outside of a group's lanes, a stage with a single lane. */
+    if (c->lane < 0) {
+        stage = add_stage(c);
+        if (!stage || add_lane(c, stage)) {
+            return;
+        }
+    }
+
+    e->steps[e->step_count++] = *step;
+    e->lanes[c->lane].count++;
+}
+
+static void skip_space(struct compiler *c) {
+    while (isspace((unsigned char)*c->p)) {
+        c->p++;
+    }
+}
+
+static int accept(struct compiler *c, char token) {
+    skip_space(c);
+
+    if (*c->p == token) {
+        c->p++;
+        return 1;
+    }
+
+    return 0;
+}
+
+static unsigned compile_chain(struct compiler *c, unsigned input);
+
+/* "[port=value, ...]" after a plugin. */
+static void compile_controls(struct compiler *c,
+                             struct ladspa_plugin *plugin) {
+    const LADSPA_Descriptor *desc = plugin->desc;
+    unsigned long port;
+    float value;
+    char *end;
+
+    if (!accept(c, '[')) {
+        return;
+    }
+
+    do {
+        skip_space(c);
+
+        port = strtoul(c->p, &end, 10);
+        if (end == c->p || port >= desc->PortCount ||
+            !LADSPA_IS_PORT_CONTROL(desc->PortDescriptors[port]) ||
+            !LADSPA_IS_PORT_INPUT(desc->PortDescriptors[port])) {
+            fail(c, "expected a control input port");
+            return;
+        }
+        c->p = end;
+
+        if (!accept(c, '=')) {
+            fail(c, "expected \"=\"");
+            return;
+        }
+
+        skip_space(c);
+
+        value = strtof(c->p, &end);
+        if (end == c->p) {
+            fail(c, "expected a value");
+            return;
+        }
+        c->p = end;
+
+        plugin->controls[port] = value;
+        connect_control(plugin, port, &plugin->controls[port]);
+    } while (accept(c, ','));
+
+    if (!accept(c, ']')) {
+        fail(c, "expected \"]\"");
+    }
+}
+
+static unsigned compile_plugin(struct compiler *c, unsigned input,
+                               const char *word, size_t len) {
+    struct effects *e = c->e;
+    struct ladspa_plugin *plugin, **tail;
+    struct step step = { STEP_RUN, .asleep = 1 };
+    char name[64];
+    unsigned long id;
+    char *end;
+
+    snprintf(name, sizeof(name), "%.*s", (int)len, word);
+
+    id = strtoul(name, &end, 10);
+    if (*end) {
+        id = find_label(c->d, name);
+    }
+
+    plugin = id ? select_plugin(c->d, id) : NULL;
+
+    /* Missing plugins are left out, rather than silencing everything. */
+    if (!plugin) {
+        printf("Leaving %s out of the effects graph\n", name);
+        return input;
+    }
+
+    for (tail = &e->plugins; *tail; tail = &(*tail)->next);
+    *tail = plugin;
+
+    hook_plugin(c->d, plugin);
+    compile_controls(c, plugin);
+
+    step.plugins[0] = plugin;
+    step.count = 1;
+    step.native = is_native(plugin->desc);
+    step.a = input;
+
+    if (c->refs[input] == 1 &&
+        !LADSPA_IS_INPLACE_BROKEN(plugin->desc->Properties)) {
+        step.out = input;
+    } else {
+        step.out = take_buffer(c);
+        release_buffer(c, input);
+    }
+
+    plugin->desc->connect_port(plugin->handle, plugin->input,
+        e->buffers[step.a]);
+    plugin->desc->connect_port(plugin->handle, plugin->output,
+        e->buffers[step.out]);
+
+    add_step(c, &step);
+
+    return step.out;
+}
+
+/* Sum the branches of a group into one buffer, a pair at a time. */
+static unsigned mix_branches(struct compiler *c, unsigned *outputs,
+                             float *gains, unsigned count) {
+    struct step step = { STEP_MIX };
+    unsigned i, acc = outputs[0];
+    float gain = gains[0];
+
+    if (count == 1 && gain == 1.0) {
+        return acc;
+    }
+
+    for (i = count == 1 ? 0 : 1; i < count; i++) {
+        step.a = acc;
+        step.gain_a = gain;
+        step.b = outputs[i];
+        step.gain_b = count == 1 ? 0.0 : gains[i];
+
+        if (c->refs[acc] == 1) {
+            step.out = acc;
+        } else if (c->refs[outputs[i]] == 1 && count > 1) {
+            step.out = outputs[i];
+        } else {
+            step.out = take_buffer(c);
+        }
+
+        add_step(c, &step);
+
+        if (step.out != step.a) {
+            release_buffer(c, step.a);
+        }
+        if (count > 1 && step.out != step.b) {
+            release_buffer(c, step.b);
+        }
+
+        acc = step.out;
+        gain = 1.0;
+    }
+
+    return acc;
+}
+
+static unsigned compile_group(struct compiler *c, unsigned input) {
+    struct stage *stage = NULL;
+    unsigned outputs[MAX_BRANCHES], count = 0, i;
+    float gains[MAX_BRANCHES];
+    int top = !c->concurrent;
+    char *end;
+
+    /* The caller's reference to the input is held until every branch is
+     * compiled, so that none runs in place over what the others still have
+     * to read. */
+    if (top) {
+        stage = add_stage(c);
+        c->concurrent = 1;
+    }
+
+    do {
+        if (count == MAX_BRANCHES) {
+            fail(c, "too many branches");
+            break;
+        }
+
+        if (top && (!stage || add_lane(c, stage))) {
+            break;
+        }
+
+        /* Each branch holds its own reference to the input. */
+        c->refs[input]++;
+        outputs[count] = compile_chain(c, input);
+
+        gains[count] = 1.0;
+        if (accept(c, '*')) {
+            gains[count] = strtof(c->p, &end);
+            if (end == c->p) {
+                fail(c, "expected a gain");
+            }
+            c->p = end;
+        }
+
+        count++;
+    } while (!c->failed && accept(c, '|'));
+
+    if (!c->failed && !accept(c, ')')) {
+        fail(c, "expected \")\"");
+    }
+
+    if (top) {
+        c->concurrent = 0;
+        c->lane = -1;
+
+        for (i = 0; i < MAX_BUFFERS; i++) {
+            c->busy[i] = 0;
+        }
+    }
+
+    release_buffer(c, input);
+
+    if (c->failed) {
+        return input;
+    }
+
+    return mix_branches(c, outputs, gains, count);
+}
+
+static unsigned compile_term(struct compiler *c, unsigned input) {
+    const char *word;
+    size_t len;
+
+    if (accept(c, '(')) {
+        return compile_group(c, input);
+    }
+
+    skip_space(c);
+
+    word = c->p;
+    while (isalnum((unsigned char)*c->p) || *c->p == '_') {
+        c->p++;
+    }
+    len = c->p - word;
+
+    if (!len) {
+        fail(c, "expected a plugin");
+        return input;
+    }
+
+    if (len == 3 && !strncmp(word, "dry", 3)) {
+        return input;
+    }
+
+    return compile_plugin(c, input, word, len);
+}
+
+static unsigned compile_chain(struct compiler *c, unsigned input) {
+    unsigned signal = compile_term(c, input);
+
+    while (!c->failed && accept(c, '>')) {
+        signal = compile_term(c, signal);
+    }
+
+    return signal;
+}
+
+struct effects* compile_effects(struct dioxide *d, const char *graph) {
+    struct compiler c = { 0 };
+    struct effects *e = calloc(1, sizeof(struct effects));
+
+    c.d = d;
+    c.e = e;
+    c.graph = c.p = graph;
+    c.lane = -1;
+
+    e->buffers[DRY] = d->front_buffer;
+    e->buffer_count = 1;
+    c.refs[DRY] = 1;
+
+    e->out = compile_chain(&c, DRY);
+
+    skip_space(&c);
+    if (!c.failed && *c.p) {
+        fail(&c, "unexpected");
+    }
+
+    if (c.failed) {
+        free_effects(e);
+        return NULL;
+    }
+
+    return e;
+}
+
+struct ladspa_plugin* effects_plugins(struct effects *e) {
+    return e->plugins;
+}
+
+void describe_effects(struct effects *e, FILE *f) {
+    struct stage *stage;
+    struct lane *lane;
+    struct step *step;
+    unsigned i, j, k, l;
+
+    fprintf(f, "Effects plan, using %u buffers:\n", e->buffer_count);
+
+    for (i = 0; i < e->stage_count; i++) {
+        stage = &e->stages[i];
+
+        for (j = stage->first; j < stage->first + stage->count; j++) {
+            lane = &e->lanes[j];
+
+            for (k = lane->first; k < lane->first + lane->count; k++) {
+                step = &e->steps[k];
+
+                fprintf(f, "  %u%c ", i, stage->count > 1 ?
+                    'a' + (j - stage->first) : ' ');
+
+                if (step->type == STEP_RUN) {
+                    fprintf(f, "%-24s %u -> %u%s\n",
+                        step->plugins[0]->desc->Label, step->a, step->out,
+                        step->count > 1 ? ", fused with" : "");
+                    for (l = 1; l < step->count; l++) {
+                        fprintf(f, "       %s\n",
+                            step->plugins[l]->desc->Label);
+                    }
+                } else {
+                    fprintf(f, "%-24s %.2f * %u + %.2f * %u -> %u\n", "mix",
+                        step->gain_a, step->a, step->gain_b, step->b,
+                        step->out);
+                }
+            }
+        }
+    }
+
+    fprintf(f, "  out %u\n", e->out);
+}
+
+static int is_silent(float *buffer, unsigned len, float silence) {
+    unsigned i;
+
+    for (i = 0; i < len; i++) {
+        if (fabsf(buffer[i]) > silence) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void run_plugins(struct dioxide *d, struct effects *e,
+                        struct step *step, unsigned len, unsigned thread) {
+    float *a = e->buffers[step->a], *out = e->buffers[step->out];
+    unsigned long long span = trace_clock(d);
+    LADSPA_Handle active[MAX_FUSED];
+    unsigned i, count = 0;
+    int silent_in;
+
+    for (i = 0; i < step->count; i++) {
+        if (plugin_is_neutral(d, step->plugins[i])) {
+            step->bypassed |= 1 << i;
+            continue;
+        }
+
+        /* Back from bypass, with whatever it held from before. Only a
+         * built-in can be cleared here; LADSPA doesn't promise that
+         * activate() is safe on the audio thread, so any other plugin
+         * picks up where it left off. */
+        if (step->bypassed & 1 << i) {
+            if (step->native) {
+                reset_native(step->plugins[i]->handle);
+            }
+            step->bypassed &= ~(1 << i);
+        }
+
+        active[count++] = step->plugins[i]->handle;
+    }
+
+    /* Its output would be its input, tail and all. */
+    if (!count) {
+        if (out != a) {
+            memcpy(out, a, len * sizeof(float));
+        }
+
+        step->asleep = 1;
+        step->quiet = 0;
+        return;
+    }
+
+    silent_in = is_silent(a, len, e->silence);
+
+    if (step->asleep && silent_in) {
+        memset(out, 0, len * sizeof(float));
+        return;
+    }
+
+    /* The input is overwritten when running in place. */
+    if (step->native) {
+        run_native(active, count, a, out, len);
+    } else {
+        fill_signals(step->plugins[0], len);
+        step->plugins[0]->desc->run(step->plugins[0]->handle, len);
+    }
+
+    trace_span(d, thread, "plugin", step->count > 1 ? "fused" :
+        step->plugins[0]->desc->Label, len, span);
+
+    if (silent_in && is_silent(out, len, e->silence)) {
+        step->quiet += len;
+        step->asleep = step->quiet >= d->rate * TAIL_MSEC / 1000;
+    } else {
+        step->quiet = 0;
+        step->asleep = 0;
+    }
+}
+
+static void run_lane(struct dioxide *d, struct effects *e, struct lane *lane,
+                     unsigned len, unsigned thread) {
+    struct step *step;
+    float *a, *b, *out;
+    unsigned long long span;
+    unsigned i, j;
+
+    for (i = lane->first; i < lane->first + lane->count; i++) {
+        step = &e->steps[i];
+        span = trace_clock(d);
+
+        switch (step->type) {
+            case STEP_RUN:
+                run_plugins(d, e, step, len, thread);
+                break;
+            case STEP_MIX:
+                a = e->buffers[step->a];
+                b = e->buffers[step->b];
+                out = e->buffers[step->out];
+
+                for (j = 0; j < len; j++) {
+                    out[j] = step->gain_a * a[j] + step->gain_b * b[j];
+                }
+
+                trace_span(d, thread, "plugin", "mix", len, span);
+                break;
+        }
+    }
+}
+
+static void run_lane_task(struct dioxide *d, void *data, unsigned index,
+                          unsigned len, unsigned thread) {
+    struct effects *e = data;
+
+    run_lane(d, e, &e->lanes[e->running->first + index], len, thread);
+}
+
+/* Run a plan over the dry voices in d->front_buffer, and return the buffer
+ * the result ended up in. Only the audio thread, thread 0, hands lanes to
+ * the workers, which are its alone. */
+static float* run_plan(struct dioxide *d, struct effects *e, unsigned len,
+                       unsigned thread) {
+    struct stage *stage;
+    unsigned i, j;
+    double volume;
+
+    if (!e) {
+        return d->front_buffer;
+    }
+
+    /* Under a quarter of the output's least significant bit. */
+    volume = d->effects_knobs.volume;
+    if (volume < QUIET_VOLUME) {
+        volume = QUIET_VOLUME;
+    }
+    e->silence = 0.25 / (32767 * volume);
+
+    for (i = 0; i < e->stage_count; i++) {
+        stage = &e->stages[i];
+
+        if (stage->count > 1 && d->workers && !thread) {
+            e->running = stage;
+            run_tasks(d, run_lane_task, e, stage->count, len);
+            continue;
+        }
+
+        for (j = stage->first; j < stage->first + stage->count; j++) {
+            run_lane(d, e, &e->lanes[j], len, thread);
+        }
+    }
+
+    return e->buffers[e->out];
+}
+
+/* Audio thread: hand the graph that was faded out back to the control
+ * thread. */
+static void retire_effects(struct dioxide *d) {
+    atomic_store_explicit(&d->retired_effects, d->fading,
+        memory_order_release);
+    d->fading = NULL;
+}
+
+/* Audio thread, between blocks: take up a newly published graph, unless
+ * the last one is still being faded out or collected. */
+static void adopt_effects(struct dioxide *d) {
+    struct effects *next;
+
+    if (d->fading ||
+        atomic_load_explicit(&d->retired_effects, memory_order_relaxed) ||
+        !atomic_load_explicit(&d->next_effects, memory_order_relaxed)) {
+        return;
+    }
+
+    next = atomic_exchange_explicit(&d->next_effects, NULL,
+        memory_order_acquire);
+
+    d->fading = d->effects;
+    d->effects = next;
+    d->fade = 0;
+}
+
+/* Audio thread: a silent block, where nothing needs to be faded. */
+void settle_effects(struct dioxide *d) {
+    adopt_effects(d);
+
+    if (d->fading) {
+        retire_effects(d);
+    }
+}
+
+/* Audio thread: run the effects over the dry voices in d->front_buffer,
+ * and return the buffer the result ended up in. thread is the caller's
+ * trace ring. */
+float* run_effects(struct dioxide *d, unsigned len, unsigned thread) {
+    unsigned fade_len = d->rate * FADE_MSEC / 1000, i;
+    float *out, gain, step;
+
+    adopt_effects(d);
+
+    if (!d->fading) {
+        return run_plan(d, d->effects, len, thread);
+    }
+
+    /* Both graphs over the same dry signal, which either may trample. */
+    memcpy(d->dry_buffer, d->front_buffer, len * sizeof(float));
+    out = run_plan(d, d->fading, len, thread);
+    memcpy(d->fade_buffer, out, len * sizeof(float));
+    memcpy(d->front_buffer, d->dry_buffer, len * sizeof(float));
+    out = run_plan(d, d->effects, len, thread);
+
+    step = 1.0 / fade_len;
+    gain = d->fade * step;
+
+    for (i = 0; i < len; i++) {
+        if (gain < 1.0) {
+            gain += step;
+        }
+
+        out[i] = gain * out[i] + (1.0 - gain) * d->fade_buffer[i];
+    }
+
+    d->fade += len;
+    if (d->fade >= fade_len) {
+        retire_effects(d);
+    }
+
+    return out;
+}
+
+/* Audio thread: whether any plugin is still awake, and must be run even
+ * with no voices playing. */
+int effects_ringing(struct dioxide *d) {
+    struct effects *e = d->effects;
+    unsigned i;
+
+    if (d->fading) {
+        return 1;
+    }
+
+    if (!e) {
+        return 0;
+    }
+
+    for (i = 0; i < e->step_count; i++) {
+        if (e->steps[i].type == STEP_RUN && !e->steps[i].asleep) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Control thread: hand a compiled plan to the audio thread. */
+void publish_effects(struct dioxide *d, struct effects *e) {
+    atomic_store_explicit(&d->next_effects, e, memory_order_release);
+}
+
+/* Control thread: free a plan the audio thread is done with, if any. */
+void reap_effects(struct dioxide *d) {
+    struct effects *e;
+
+    e = atomic_exchange_explicit(&d->retired_effects, NULL,
+        memory_order_acquire);
+
+    free_effects(e);
+}
+
+/* Control thread: replace the running graph. Returns nonzero if it
+ * couldn't. */
+int swap_effects(struct dioxide *d, const char *graph) {
+    struct effects *e;
+
+    reap_effects(d);
+
+    if (atomic_load(&d->next_effects)) {
+        printf("Still swapping in the last graph; try again\n");
+        return -1;
+    }
+
+    e = compile_effects(d, graph);
+    if (!e) {
+        return -1;
+    }
+
+    describe_effects(e, stdout);
+    publish_effects(d, e);
+
+    /* A paused backend has no blocks to take the graph up between. */
+    d->backend->resume(d);
+
+    return 0;
+}
+
+/* Once the audio thread has stopped. */
+void cleanup_effects(struct dioxide *d) {
+    reap_effects(d);
+    free_effects(atomic_exchange(&d->next_effects, NULL));
+    free_effects(d->fading);
+    free_effects(d->effects);
+
+    d->fading = NULL;
+    d->effects = NULL;
+}
+
+void free_effects(struct effects *e) {
+    struct ladspa_plugin *plugin, *doomed;
+    unsigned i;
+
+    if (!e) {
+        return;
+    }
+
+    plugin = e->plugins;
+    while (plugin) {
+        doomed = plugin;
+        plugin = plugin->next;
+        release_plugin(doomed);
+    }
+
+    /* Not buffer 0; that's the engine's. */
+    for (i = DRY + 1; i < e->buffer_count; i++) {
+        free(e->buffers[i]);
+    }
+
+    free(e);
+}
@@ -0,0 +1,98 @@
+#include <math.h>
+
+#include "dioxide.h"
+
+/* Envelopes are stepped a block at a time. Each stage is a straight ramp
+ * towards its target, so a block is only ever a few segments, and each
+ * segment is filled without any per-sample branching or division. */
+
+/* Per-sample increments for a unit-height stage; the times only change
+ * between buffers. */
+void update_envelopes(struct dioxide *d) {
+    d->attack_step = d->inverse_sample_rate / d->attack_time;
+    d->decay_step = d->inverse_sample_rate / d->decay_time;
+    d->release_step = d->inverse_sample_rate / d->release_time;
+}
+
+/* Ramp *volume towards target by step per sample, writing up to count gains
+ * stride apart. Stops early, with *volume exactly on target, once it gets
+ * there. Returns the number of gains written. */
+static unsigned ramp(float *gains, unsigned stride, unsigned count,
+                     float *volume, float step, float target) {
+    float start = *volume, remaining = (target - start) / step;
+    unsigned i, n;
+
+    /* Already there; also catches 0/0 when a stage has no height. */
+    if (!(remaining > 0)) {
+        *volume = target;
+        return 0;
+    }
+
+    n = remaining < count ? (unsigned)ceilf(remaining) : count;
+
+    for (i = 0; i < n; i++) {
+        gains[i * stride] = start + step * (i + 1);
+    }
+
+    if (remaining < count) {
+        gains[(n - 1) * stride] = target;
+        *volume = target;
+    } else {
+        *volume = start + step * n;
+    }
+
+    return n;
+}
+
+/* Step one voice's envelope through count samples, using the shape of the
+ * element it was started with, and write its gain for each sample to gains,
+ * stride floats apart. Returns how many of the samples were spent in attack
+ * or decay. */
+unsigned step_envelope(struct dioxide *d, struct voices *v, unsigned voice,
+                       float *gains, unsigned stride, unsigned count) {
+    const struct element *element = v->element[voice];
+    float *volume = &v->adsr_volume[voice];
+    float peak = element->peak, sustain = element->sustain;
+    unsigned i = 0, speaking = 0;
+
+    while (i < count) {
+        switch (v->adsr_phase[voice]) {
+            case ADSR_ATTACK:
+                i += ramp(gains + i * stride, stride, count - i, volume,
+                    peak * d->attack_step, peak);
+                speaking = i;
+
+                if (*volume == peak) {
+                    v->adsr_phase[voice] = ADSR_DECAY;
+                }
+                break;
+            case ADSR_DECAY:
+                i += ramp(gains + i * stride, stride, count - i, volume,
+                    (sustain - peak) * d->decay_step, sustain);
+                speaking = i;
+
+                if (*volume == sustain) {
+                    v->adsr_phase[voice] = ADSR_SUSTAIN;
+                }
+                break;
+            case ADSR_SUSTAIN:
+                for (; i < count; i++) {
+                    gains[i * stride] = *volume;
+                }
+                break;
+            case ADSR_RELEASE:
+                i += ramp(gains + i * stride, stride, count - i, volume,
+                    -sustain * d->release_step, 0.0);
+
+                for (; i < count; i++) {
+                    gains[i * stride] = 0.0;
+                }
+                break;
+            default:
+                i = count;
+                break;
+        }
+    }
+
+    return speaking;
+}
@@ -0,0 +1,443 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dioxide.h"
+#include "osc.h"
+
+/* Built-in chorus, phaser and 4-pole low-pass filter, standing in for the
+ * CAPS and blop plugins of the same UniqueIDs, labels and ports, so that
+ * graphs, hooks and control overrides work on either. They are presented
+ * as LADSPA descriptors, but consecutive built-ins running in place are
+ * fused by the effects compiler into one pass: run_native() walks the
+ * block a chunk at a time, and every effect processes the chunk while it
+ * is still in L1.
+ *
+ * The phaser and filter are recursive and run sample by sample; their
+ * coefficients are worked out once a chunk. The chorus reads its delay
+ * line further back than a chunk, so its modulated taps are a separate
+ * loop with no dependencies between samples, which vectorizes. State is
+ * copied into locals for the length of a chunk, as the compiler can't tell
+ * that it doesn't alias the samples. */
+
+/* Samples processed by each effect in turn; also how often the phaser's
+ * sweep is updated, as in CAPS. */
+#define FX_CHUNK 32
+
+#define FX_PORTS 8
+
+/* Kept out of feedback paths so they never decay into denormals. */
+#define ANTI_DENORMAL 1e-20f
+
+struct fx {
+    void (*process)(struct fx *fx, float *samples, unsigned count);
+    void (*reset)(struct fx *fx);
+    LADSPA_Data *ports[FX_PORTS];
+    unsigned input, output;
+    float rate;
+};
+
+static float port_value(struct fx *fx, unsigned port, float low, float high) {
+    float value = *fx->ports[port];
+
+    return value < low ? low : value > high ? high : value;
+}
+
+/* Chorus, after CAPS ChorusI: a delay line tapped once at a fixed delay
+ * for feedback, and once swept by a sine for the chorus itself. */
+
+#define CHORUS_MAX_MSEC 50
+
+struct chorus {
+    struct fx fx;
+
+    float *delay;
+    unsigned mask, write;
+
+    /* Delay and sweep width in samples, glided between chunks. */
+    float t, width;
+    uint32_t phase;
+};
+
+/* Sample pos samples before the one at write, with cubic interpolation. */
+static inline float chorus_tap(const float *delay, unsigned mask,
+                               unsigned write, float pos) {
+    int n = (int)pos;
+    float f = pos - n, xm1, x0, x1, x2, a, b, k;
+
+    xm1 = delay[(write - n + 1) & mask];
+    x0 = delay[(write - n) & mask];
+    x1 = delay[(write - n - 1) & mask];
+    x2 = delay[(write - n - 2) & mask];
+
+    a = (3 * (x0 - x1) - xm1 + x2) * 0.5f;
+    b = 2 * x1 + xm1 - (5 * x0 + x2) * 0.5f;
+    k = (x1 - xm1) * 0.5f;
+
+    return x0 + ((a * f + b) * f + k) * f;
+}
+
+static void chorus_process(struct fx *fx, float *samples, unsigned count) {
+    struct chorus *c = (struct chorus*)fx;
+    float ms = fx->rate * 0.001f, t, width, dt, dw, blend, ff, fb, m;
+    float t0 = c->t, width0 = c->width, *delay = c->delay;
+    unsigned i, write = c->write, mask = c->mask;
+    uint32_t step, phase = c->phase;
+
+    t = port_value(fx, 1, 2.5, 40) * ms;
+    if (t < 3) {
+        t = 3;
+    }
+    width = port_value(fx, 2, 0.5, 10) * ms;
+    if (width > t - 3) {
+        width = t - 3;
+    }
+
+    dt = (t - t0) / count;
+    dw = (width - width0) / count;
+
+    step = osc_step(port_value(fx, 3, 0, 5), 1.0 / fx->rate);
+    blend = port_value(fx, 4, 0, 1);
+    ff = port_value(fx, 5, 0, 1);
+    fb = port_value(fx, 6, 0, 1);
+
+    /* Feedback from a whole number of samples back, then into the line;
+     * samples keeps what went in. */
+    for (i = 0; i < count; i++) {
+        samples[i] -= fb * delay[(write + i - (int)(t0 + dt * i)) & mask];
+        delay[(write + i) & mask] = samples[i] + ANTI_DENORMAL;
+    }
+
+    /* The sweep never reaches back less than 3 samples, so every tap here
+     * reads what the loop above has already written. */
+    for (i = 0; i < count; i++) {
+        m = osc_sin(phase + step * i);
+        samples[i] = blend * samples[i] + ff * chorus_tap(delay, mask,
+            write + i, t0 + dt * i + (width0 + dw * i) * m);
+    }
+
+    c->write = write + count;
+    c->t = t;
+    c->width = width;
+    c->phase = phase + step * count;
+}
+
+static void chorus_reset(struct fx *fx) {
+    struct chorus *c = (struct chorus*)fx;
+
+    memset(c->delay, 0, (c->mask + 1) * sizeof(float));
+    c->write = 0;
+    c->t = port_value(fx, 1, 2.5, 40) * fx->rate * 0.001f;
+    c->width = 0;
+    c->phase = 0;
+}
+
+/* Phaser, after CAPS PhaserI: six first-order allpasses with feedback,
+ * their corners swept between 400 and 2600 Hz and spread apart. */
+
+#define PHASER_NOTCHES 6
+
+struct phaser {
+    struct fx fx;
+
+    float z[PHASER_NOTCHES];
+    float y;
+    uint32_t phase;
+};
+
+static void phaser_process(struct fx *fx, float *samples, unsigned count) {
+    struct phaser *p = (struct phaser*)fx;
+    float a[PHASER_NOTCHES], z[PHASER_NOTCHES], depth, spread, fb, m, x, y;
+    float out;
+    unsigned i, j;
+
+    depth = port_value(fx, 2, 0, 1);
+    spread = 1 + port_value(fx, 3, 0, M_PI_2);
+    fb = port_value(fx, 4, 0, 0.999);
+
+    m = (400 + 2200 * (1 - fabsf(osc_sin(p->phase)))) / fx->rate;
+    for (j = 0; j < PHASER_NOTCHES; j++) {
+        a[j] = (1 - m) / (1 + m);
+        m *= spread;
+    }
+
+    p->phase += osc_step(port_value(fx, 1, 0.001, 1), 1.0 / fx->rate) *
+        count;
+
+    memcpy(z, p->z, sizeof(z));
+    y = p->y;
+
+    for (i = 0; i < count; i++) {
+        x = samples[i];
+        y = x + y * fb + ANTI_DENORMAL;
+
+        for (j = 0; j < PHASER_NOTCHES; j++) {
+            out = z[j] - a[j] * y;
+            z[j] = a[j] * out + y;
+            y = out;
+        }
+
+        samples[i] = x + y * depth;
+    }
+
+    memcpy(p->z, z, sizeof(z));
+    p->y = y;
+}
+
+static void phaser_reset(struct fx *fx) {
+    struct phaser *p = (struct phaser*)fx;
+
+    memset(p->z, 0, sizeof(p->z));
+    p->y = 0;
+    p->phase = 0;
+}
+
+/* Four-pole resonant low-pass, after blop's lp4pole: four one-pole
+ * sections with their output fed back to the input. */
+
+struct lpf {
+    struct fx fx;
+
+    float in[4], out[4];
+};
+
+static void lpf_process(struct fx *fx, float *samples, unsigned count) {
+    struct lpf *l = (struct lpf*)fx;
+    float f, fb, gain, x, in[4], out[4];
+    unsigned i, j;
+
+    f = port_value(fx, 0, 0, fx->rate * 0.5) * 2 / fx->rate * 1.16f;
+    gain = 0.35013f * f * f * f * f;
+    fb = port_value(fx, 1, 0, 4) * (1 - 0.15f * f * f) * gain;
+
+    memcpy(in, l->in, sizeof(in));
+    memcpy(out, l->out, sizeof(out));
+
+    /* Grouped so that as little as possible waits on the sample before. */
+    for (i = 0; i < count; i++) {
+        x = (samples[i] * gain + ANTI_DENORMAL) - out[3] * fb;
+
+        for (j = 0; j < 4; j++) {
+            out[j] = x + (0.3f * in[j] + (1 - f) * out[j]);
+            in[j] = x;
+            x = out[j];
+        }
+
+        samples[i] = x;
+    }
+
+    memcpy(l->in, in, sizeof(in));
+    memcpy(l->out, out, sizeof(out));
+}
+
+static void lpf_reset(struct fx *fx) {
+    struct lpf *l = (struct lpf*)fx;
+
+    memset(l->in, 0, sizeof(l->in));
+    memset(l->out, 0, sizeof(l->out));
+}
+
+/* The LADSPA face of it all. */
+
+static LADSPA_Handle fx_instantiate(const LADSPA_Descriptor *desc,
+                                    unsigned long rate) {
+    struct chorus *c;
+    struct fx *fx;
+    unsigned size;
+
+    switch (desc->UniqueID) {
+        case 2583:
+            c = calloc(1, sizeof(struct chorus));
+            for (size = 1; size < rate * CHORUS_MAX_MSEC / 1000 + 4;
+                 size <<= 1);
+            c->delay = calloc(size, sizeof(float));
+            c->mask = size - 1;
+            fx = &c->fx;
+            fx->process = chorus_process;
+            fx->reset = chorus_reset;
+            fx->output = 7;
+            break;
+        case 2586:
+            fx = calloc(1, sizeof(struct phaser));
+            fx->process = phaser_process;
+            fx->reset = phaser_reset;
+            fx->output = 5;
+            break;
+        default:
+            fx = calloc(1, sizeof(struct lpf));
+            fx->process = lpf_process;
+            fx->reset = lpf_reset;
+            fx->input = 2;
+            fx->output = 3;
+            break;
+    }
+
+    fx->rate = rate;
+
+    return fx;
+}
+
+static void fx_connect_port(LADSPA_Handle handle, unsigned long port,
+                            LADSPA_Data *data) {
+    struct fx *fx = handle;
+
+    if (port < FX_PORTS) {
+        fx->ports[port] = data;
+    }
+}
+
+static void fx_activate(LADSPA_Handle handle) {
+    struct fx *fx = handle;
+
+    fx->reset(fx);
+}
+
+static void fx_run(LADSPA_Handle handle, unsigned long count) {
+    struct fx *fx = handle;
+
+    run_native(&handle, 1, fx->ports[fx->input], fx->ports[fx->output],
+        count);
+}
+
+static void fx_cleanup(LADSPA_Handle handle) {
+    struct fx *fx = handle;
+
+    if (fx->process == chorus_process) {
+        free(((struct chorus*)fx)->delay);
+    }
+
+    free(fx);
+}
+
+#define AI (LADSPA_PORT_AUDIO | LADSPA_PORT_INPUT)
+#define AO (LADSPA_PORT_AUDIO | LADSPA_PORT_OUTPUT)
+#define CI (LADSPA_PORT_CONTROL | LADSPA_PORT_INPUT)
+#define BOUNDED (LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE)
+
+static const LADSPA_PortDescriptor chorus_ports[] = {
+    AI, CI, CI, CI, CI, CI, CI, AO,
+};
+static const char * const chorus_names[] = {
+    "in", "t (ms)", "width (ms)", "rate (Hz)", "blend", "feedforward",
+    "feedback", "out",
+};
+static const LADSPA_PortRangeHint chorus_hints[] = {
+    { 0 },
+    { BOUNDED | LADSPA_HINT_DEFAULT_LOW, 2.5, 40 },
+    { BOUNDED | LADSPA_HINT_DEFAULT_1, 0.5, 10 },
+    { BOUNDED | LADSPA_HINT_DEFAULT_LOW, 0, 5 },
+    { BOUNDED | LADSPA_HINT_DEFAULT_1, 0, 1 },
+    { BOUNDED | LADSPA_HINT_DEFAULT_LOW, 0, 1 },
+    { BOUNDED | LADSPA_HINT_DEFAULT_0, 0, 1 },
+    { 0 },
+};
+
+static const LADSPA_PortDescriptor phaser_ports[] = {
+    AI, CI, CI, CI, CI, AO,
+};
+static const char * const phaser_names[] = {
+    "in", "rate (Hz)", "depth", "spread", "feedback", "out",
+};
+static const LADSPA_PortRangeHint phaser_hints[] = {
+    { 0 },
+    { BOUNDED | LADSPA_HINT_DEFAULT_LOW, 0, 1 },
+    { BOUNDED | LADSPA_HINT_DEFAULT_HIGH, 0, 1 },
+    { BOUNDED | LADSPA_HINT_DEFAULT_MIDDLE, 0, M_PI_2 },
+    { BOUNDED | LADSPA_HINT_DEFAULT_MIDDLE, 0, 0.999 },
+    { 0 },
+};
+
+static const LADSPA_PortDescriptor lpf_ports[] = {
+    CI, CI, AI, AO,
+};
+static const char * const lpf_names[] = {
+    "Cutoff Frequency", "Resonance", "Input", "Output",
+};
+static const LADSPA_PortRangeHint lpf_hints[] = {
+    { BOUNDED | LADSPA_HINT_SAMPLE_RATE | LADSPA_HINT_LOGARITHMIC |
+      LADSPA_HINT_DEFAULT_MAXIMUM, 0.0001, 0.5 },
+    { BOUNDED | LADSPA_HINT_DEFAULT_MINIMUM, 0, 4 },
+    { 0 },
+    { 0 },
+};
+
+#define NATIVE(id, label, name, ports) { \
+    id, label, LADSPA_PROPERTY_REALTIME | LADSPA_PROPERTY_HARD_RT_CAPABLE, \
+    name, "dioxide", "None", \
+    sizeof(ports##_ports) / sizeof(ports##_ports[0]), ports##_ports, \
+    ports##_names, ports##_hints, NULL, fx_instantiate, fx_connect_port, \
+    fx_activate, fx_run, NULL, NULL, NULL, fx_cleanup, \
+}
+
+static const LADSPA_Descriptor natives[] = {
+    NATIVE(2583, "ChorusI", "Chorus (built in)", chorus),
+    NATIVE(2586, "PhaserI", "Phaser (built in)", phaser),
+    NATIVE(1671, "lp4pole_fcrcia_oa", "4-pole low-pass (built in)", lpf),
+    NATIVE(1672, "lp4pole_faraia_oa", "4-pole low-pass (built in)", lpf),
+};
+
+#define NATIVE_COUNT (sizeof(natives) / sizeof(natives[0]))
+
+/* Run effects one after another over in, leaving the result in out, which
+ * may be in. */
+void run_native(LADSPA_Handle *handles, unsigned count, const float *in,
+                float *out, unsigned long len) {
+    unsigned long start, chunk;
+    struct fx *fx;
+    unsigned i;
+
+    for (start = 0; start < len; start += chunk) {
+        chunk = len - start < FX_CHUNK ? len - start : FX_CHUNK;
+
+        if (in != out) {
+            memcpy(out + start, in + start, chunk * sizeof(float));
+        }
+
+        for (i = 0; i < count; i++) {
+            fx = handles[i];
+            fx->process(fx, out + start, chunk);
+        }
+    }
+}
+
+/* Clear a built-in's state, as when it comes back from being bypassed.
+ * Nothing is freed or allocated, so the audio thread may call it. */
+void reset_native(LADSPA_Handle handle) {
+    struct fx *fx = handle;
+
+    fx->reset(fx);
+}
+
+const LADSPA_Descriptor* native_descriptor(unsigned long id) {
+    unsigned i;
+
+    for (i = 0; i < NATIVE_COUNT; i++) {
+        if (natives[i].UniqueID == id) {
+            return &natives[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* The UniqueID of a built-in with this label, or zero. */
+unsigned long find_native_label(const char *label) {
+    unsigned i;
+
+    for (i = 0; i < NATIVE_COUNT; i++) {
+        if (!strcmp(natives[i].Label, label)) {
+            return natives[i].UniqueID;
+        }
+    }
+
+    return 0;
+}
+
+int is_native(const LADSPA_Descriptor *desc) {
+    return desc >= natives && desc < natives + NATIVE_COUNT;
+}
+
+/* The ith built-in, or NULL past the last. */
+const LADSPA_Descriptor* native_at(unsigned i) {
+    return i < NATIVE_COUNT ? &natives[i] : NULL;
+}
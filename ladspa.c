@@ -1,129 +1,260 @@
-#include <dlfcn.h>
+#include <math.h>
 #include <stdio.h>
 
 #include "dioxide.h"
 
-void open_plugin(struct dioxide *d, const char *name) {
-    void* handle;
-    LADSPA_Descriptor_Function ladspa_descriptor;
-    const LADSPA_Descriptor *desc;
-    struct ladspa_plugin *plugin, *iter;
-    unsigned i = 0;
+/* What a control port holds until something else is connected to it, from
+ * its range hint. */
+static LADSPA_Data default_control(const LADSPA_PortRangeHint *hint,
+                                   unsigned rate) {
+    LADSPA_PortRangeHintDescriptor h = hint->HintDescriptor;
+    float low = hint->LowerBound, high = hint->UpperBound, value;
 
-    handle = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+    if (LADSPA_IS_HINT_SAMPLE_RATE(h)) {
+        low *= rate;
+        high *= rate;
+    }
 
-    if (!handle) {
-        printf("Couldn't load plugin %s: %s\n", name, dlerror());
-        return;
+    switch (h & LADSPA_HINT_DEFAULT_MASK) {
+        case LADSPA_HINT_DEFAULT_MINIMUM:
+            return low;
+        case LADSPA_HINT_DEFAULT_LOW:
+            value = LADSPA_IS_HINT_LOGARITHMIC(h) ?
+                exp(log(low) * 0.75 + log(high) * 0.25) :
+                low * 0.75 + high * 0.25;
+            break;
+        case LADSPA_HINT_DEFAULT_MIDDLE:
+            value = LADSPA_IS_HINT_LOGARITHMIC(h) ?
+                sqrt(low * high) : (low + high) * 0.5;
+            break;
+        case LADSPA_HINT_DEFAULT_HIGH:
+            value = LADSPA_IS_HINT_LOGARITHMIC(h) ?
+                exp(log(low) * 0.25 + log(high) * 0.75) :
+                low * 0.25 + high * 0.75;
+            break;
+        case LADSPA_HINT_DEFAULT_MAXIMUM:
+            return high;
+        case LADSPA_HINT_DEFAULT_1:
+            return 1;
+        case LADSPA_HINT_DEFAULT_100:
+            return 100;
+        case LADSPA_HINT_DEFAULT_440:
+            return 440;
+        default:
+            return LADSPA_IS_HINT_BOUNDED_BELOW(h) ? low : 0;
     }
 
-    ladspa_descriptor = dlsym(handle, "ladspa_descriptor");
+    return LADSPA_IS_HINT_INTEGER(h) ? roundf(value) : value;
+}
 
-    if (!ladspa_descriptor) {
-        printf("Couldn't describe plugin %s: %s\n", name, dlerror());
-        return;
+/* Where the plugins we know take and give their signal. The blop filters
+ * have audio ports ahead of their input, for cutoff and resonance. */
+static const struct {
+    unsigned id, input, output;
+} known_ports[] = {
+    /* Chorus */
+    { 2583, 0, 7 },
+    /* Phaser */
+    { 2586, 0, 5 },
+    /* LPF */
+    { 1671, 2, 3 },
+    { 1672, 2, 3 },
+};
+
+#define KNOWN_PORTS (sizeof(known_ports) / sizeof(known_ports[0]))
+
+/* The audio ports a plugin's signal goes in and out of: from the table if
+ * we know it, or else the first audio port each way, as ours is a mono
+ * signal path. */
+static void find_signal(const LADSPA_Descriptor *desc, int *input,
+                        int *output) {
+    LADSPA_PortDescriptor port;
+    unsigned long i;
+
+    for (i = 0; i < KNOWN_PORTS; i++) {
+        if (known_ports[i].id == desc->UniqueID &&
+            known_ports[i].input < desc->PortCount &&
+            known_ports[i].output < desc->PortCount) {
+            *input = known_ports[i].input;
+            *output = known_ports[i].output;
+            return;
+        }
     }
 
-    while (desc = ladspa_descriptor(i)) {
-        plugin = calloc(1, sizeof(struct ladspa_plugin));
-        plugin->desc = desc;
+    for (i = 0; i < desc->PortCount; i++) {
+        port = desc->PortDescriptors[i];
 
-        /* Stash the plugin. */
-        if (!d->available_plugins) {
-            d->available_plugins = plugin;
-        } else {
-            iter = d->available_plugins;
-            while (iter->next) {
-                iter = iter->next;
-            }
-            iter->next = plugin;
+        if (!LADSPA_IS_PORT_AUDIO(port)) {
+            continue;
         }
 
-        printf("Loaded plugin %s\n", desc->Name);
-        i++;
+        if (LADSPA_IS_PORT_INPUT(port) && *input < 0) {
+            *input = i;
+        } else if (LADSPA_IS_PORT_OUTPUT(port) && *output < 0) {
+            *output = i;
+        }
     }
-
-    plugin->dl_handle = handle;
 }
 
+/* A new, activated instance of a plugin. Its control ports are connected to
+ * their defaults in plugin->controls, and any audio ports besides its input
+ * and output to signals of their own; its input and output are found but
+ * not yet connected. */
 struct ladspa_plugin* select_plugin(struct dioxide *d, unsigned id) {
-    struct ladspa_plugin *plugin, *iter;
+    struct ladspa_plugin *plugin;
+    const LADSPA_Descriptor *desc;
+    int input = -1, output = -1;
+    unsigned long i;
 
-    iter = d->available_plugins;
-    while (iter) {
-        if (iter->desc->UniqueID == id) {
-            break;
-        }
-        iter = iter->next;
-    }
-    if (!iter) {
+    desc = load_descriptor(d, id);
+    if (!desc) {
         printf("Couldn't select plugin %d\n", id);
         return NULL;
     }
 
-    plugin = calloc(1, sizeof(struct ladspa_plugin));
-    plugin->desc = iter->desc;
+    find_signal(desc, &input, &output);
+
+    if (input < 0 || output < 0) {
+        printf("Plugin %d doesn't have audio in and out\n", id);
+        return NULL;
+    }
 
-    plugin->handle = plugin->desc->instantiate(plugin->desc, d->spec.freq);
+    plugin = calloc(1, sizeof(struct ladspa_plugin));
+    plugin->desc = desc;
+    plugin->input = input;
+    plugin->output = output;
+    plugin->controls = calloc(desc->PortCount, sizeof(LADSPA_Data));
+    plugin->ports = calloc(desc->PortCount, sizeof(LADSPA_Data*));
+    plugin->signals = calloc(desc->PortCount, sizeof(LADSPA_Data*));
+
+    plugin->handle = plugin->desc->instantiate(plugin->desc, d->rate);
     if (!plugin->handle) {
         printf("Failed to instantiate plugin %d\n", id);
+        free(plugin->controls);
+        free(plugin->ports);
+        free(plugin->signals);
         free(plugin);
         return NULL;
     }
 
+    /* Every port must be connected before the plugin is run. */
+    for (i = 0; i < desc->PortCount; i++) {
+        if (i == plugin->input || i == plugin->output) {
+            continue;
+        }
+
+        if (LADSPA_IS_PORT_AUDIO(desc->PortDescriptors[i])) {
+            plugin->signals[i] = calloc(d->samples, sizeof(LADSPA_Data));
+            plugin->desc->connect_port(plugin->handle, i,
+                plugin->signals[i]);
+        }
+
+        if (desc->PortRangeHints) {
+            plugin->controls[i] = default_control(&desc->PortRangeHints[i],
+                d->rate);
+        }
+
+        connect_control(plugin, i, &plugin->controls[i]);
+    }
+
     if (plugin->desc->activate) {
         plugin->desc->activate(plugin->handle);
     }
 
-    /* Stash the plugin. */
-    if (!d->plugin_chain) {
-        d->plugin_chain = plugin;
-    } else {
-        iter = d->plugin_chain;
-        while (iter && iter->next) {
-            iter = iter->next;
-        }
-        iter->next = plugin;
+    return plugin;
+}
+
+void release_plugin(struct ladspa_plugin *plugin) {
+    unsigned long i;
+
+    if (plugin->desc->deactivate) {
+        plugin->desc->deactivate(plugin->handle);
+    }
+    if (plugin->desc->cleanup) {
+        plugin->desc->cleanup(plugin->handle);
     }
 
-    return plugin;
+    for (i = 0; i < plugin->desc->PortCount; i++) {
+        free(plugin->signals[i]);
+    }
+
+    free(plugin->controls);
+    free(plugin->ports);
+    free(plugin->signals);
+    free(plugin);
+}
+
+/* Connect a control port, remembering where, so that its value can be
+ * checked while running. An audio port stays on its own signal, which
+ * fill_signals() holds at the value. */
+void connect_control(struct ladspa_plugin *plugin, unsigned long port,
+                     LADSPA_Data *data) {
+    plugin->ports[port] = data;
+
+    if (!plugin->signals[port]) {
+        plugin->desc->connect_port(plugin->handle, port, data);
+    }
+}
+
+/* Before running a plugin for len samples, hold each of its extra audio
+ * inputs at its control's value. */
+void fill_signals(struct ladspa_plugin *plugin, unsigned len) {
+    LADSPA_Data value;
+    unsigned long i;
+    unsigned j;
+
+    for (i = 0; i < plugin->desc->PortCount; i++) {
+        if (!plugin->signals[i] ||
+            !LADSPA_IS_PORT_INPUT(plugin->desc->PortDescriptors[i])) {
+            continue;
+        }
+
+        value = *plugin->ports[i];
+        for (j = 0; j < len; j++) {
+            plugin->signals[i][j] = value;
+        }
+    }
 }
 
 void setup_plugins(struct dioxide *d) {
     struct ladspa_plugin *plugin;
+    struct effects *e;
     unsigned i = 1;
 
-    open_plugin(d, "caps.so");
-    open_plugin(d, "lp4pole_1671.so");
+    setup_catalog(d);
 
-    /* Chorus */
-    plugin = select_plugin(d, 2583);
-    if (plugin) {
-        plugin->input = 0;
-        plugin->output = 7;
-    }
+    e = compile_effects(d,
+        d->effects_graph ? d->effects_graph : DEFAULT_EFFECTS);
 
-    /* Phaser */
-    plugin = select_plugin(d, 2586);
-    if (plugin) {
-        plugin->input = 0;
-        plugin->output = 5;
-    }
-
-    /* LPF */
-    plugin = select_plugin(d, 1672);
-    if (plugin) {
-        plugin->input = 2;
-        plugin->output = 3;
+    if (!e) {
+        printf("Running without effects\n");
+        return;
     }
 
     printf("Prepared plugin chain\n");
-    plugin = d->plugin_chain;
+    plugin = effects_plugins(e);
     while (plugin) {
         printf("%d: %s (%p)\n", i, plugin->desc->Name, plugin->handle);
         plugin = plugin->next;
         i++;
     }
+    describe_effects(e, stdout);
+
+    /* Only the default graph is expected to hold all three; a graph given
+     * with -e holds whatever it was asked to. */
+    if (!d->effects_graph && !find_plugin_by_id(effects_plugins(e), 2586)) {
+        printf("Couldn't set up phaser!\n");
+    }
+    if (!d->effects_graph && !find_plugin_by_id(effects_plugins(e), 2583)) {
+        printf("Couldn't set up chorus!\n");
+    }
+    if (!d->effects_graph && !find_plugin_by_id(effects_plugins(e), 1672)) {
+        printf("Couldn't set up low-pass filter!\n");
+    }
+
+    /* The audio thread may already be running, so this goes the same way
+     * as any later graph. */
+    publish_effects(d, e);
 }
 
 struct ladspa_plugin* find_plugin_by_id(struct ladspa_plugin *plugin,
@@ -140,70 +271,64 @@ struct ladspa_plugin* find_plugin_by_id(struct ladspa_plugin *plugin,
     return NULL;
 }
 
-void hook_plugins(struct dioxide *d) {
-    struct ladspa_plugin *plugin;
+static void hook_phaser(struct dioxide *d, struct ladspa_plugin *plugin) {
+    connect_control(plugin, 1, &d->effects_knobs.phaser_rate);
+    connect_control(plugin, 2, &d->effects_knobs.phaser_depth);
+    connect_control(plugin, 3, &d->effects_knobs.phaser_spread);
+    connect_control(plugin, 4, &d->effects_knobs.phaser_feedback);
+}
 
-    /* Phaser */
-    plugin = find_plugin_by_id(d->plugin_chain, 2586);
+static void hook_chorus(struct dioxide *d, struct ladspa_plugin *plugin) {
+    connect_control(plugin, 1, &d->effects_knobs.chorus_delay);
 
-    if (!plugin) {
-        printf("Couldn't set up phaser!\n");
-    } else {
-        plugin->desc->connect_port(plugin->handle, 1, &d->phaser_rate);
-        plugin->desc->connect_port(plugin->handle, 2, &d->phaser_depth);
-        plugin->desc->connect_port(plugin->handle, 3, &d->phaser_spread);
-        plugin->desc->connect_port(plugin->handle, 4, &d->phaser_feedback);
-    }
-
-    /* Chorus */
-    plugin = find_plugin_by_id(d->plugin_chain, 2583);
+    /* Width, feedforward and feedback. */
+    plugin->controls[2] = 7;
+    plugin->controls[5] = 0.5;
+    plugin->controls[6] = 0.4;
+}
 
-    if (!plugin) {
-        printf("Couldn't set up chorus!\n");
-    } else {
-        plugin->desc->connect_port(plugin->handle, 1, &d->chorus_delay);
+static void hook_lpf(struct dioxide *d, struct ladspa_plugin *plugin) {
+    connect_control(plugin, 0, &d->effects_knobs.lpf_cutoff);
+    connect_control(plugin, 1, &d->effects_knobs.lpf_resonance);
+}
 
-        static float chorus_width = 7;
-        static float chorus_feedforward = 0.5;
-        static float chorus_feedback = 0.4;
-        plugin->desc->connect_port(plugin->handle, 2, &chorus_width);
-        plugin->desc->connect_port(plugin->handle, 5, &chorus_feedforward);
-        plugin->desc->connect_port(plugin->handle, 6, &chorus_feedback);
+/* Wire the controls of the plugins we know to the knobs in d. */
+void hook_plugin(struct dioxide *d, struct ladspa_plugin *plugin) {
+    switch (plugin->desc->UniqueID) {
+        /* Phaser */
+        case 2586:
+            hook_phaser(d, plugin);
+            break;
+        /* Chorus */
+        case 2583:
+            hook_chorus(d, plugin);
+            break;
+        /* LPF */
+        case 1672:
+            hook_lpf(d, plugin);
+            break;
+        default:
+            break;
     }
+}
 
-    /* LPF */
-    plugin = find_plugin_by_id(d->plugin_chain, 1672);
-
-    if (!plugin) {
-        printf("Couldn't set up low-pass filter!\n");
-    } else {
-        plugin->desc->connect_port(plugin->handle, 0, &d->lpf_cutoff);
-        plugin->desc->connect_port(plugin->handle, 1, &d->lpf_resonance);
+/* Whether a plugin we know has its controls set so that its output would
+ * be its input, in which case it needn't be run at all. Called by the audio
+ * thread every block. */
+int plugin_is_neutral(struct dioxide *d, struct ladspa_plugin *plugin) {
+    switch (plugin->desc->UniqueID) {
+        /* Phaser, with no depth to its sweep. The LPF is never inert: even
+         * wide open and without resonance it still rolls off the top. */
+        case 2586:
+            return *plugin->ports[2] == 0;
+        default:
+            return 0;
     }
 }
 
 void cleanup_plugins(struct dioxide *d) {
-    struct ladspa_plugin *plugin, *doomed;
-
-    plugin = d->plugin_chain;
-    while (plugin) {
-        doomed = plugin;
-        if (plugin->desc->deactivate) {
-            plugin->desc->deactivate(plugin->handle);
-        }
-
-        plugin = plugin->next;
-        free(doomed);
-    }
-
-    plugin = d->available_plugins;
-    while (plugin) {
-        doomed = plugin;
-        if (plugin->dl_handle) {
-            dlclose(plugin->dl_handle);
-        }
+    cleanup_effects(d);
 
-        plugin = plugin->next;
-        free(doomed);
-    }
+    /* Only once no instances are left. */
+    cleanup_catalog(d);
 }
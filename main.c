@@ -1,253 +1,473 @@
 #include <complex.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
-
-#include <sys/time.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 #include "dioxide.h"
 
-static int time_to_quit = 0;
-static unsigned long frame_length = 0;
-
-void handle_sigint(int s) {
-    time_to_quit = 1;
-    printf("Caught SIGINT, quitting.\n");
-}
+/* The control thread sleeps in poll() on the sequencer, a signalfd, a
+ * once a second timerfd and the control FIFO, and only wakes when one of
+ * them has something. */
+enum {
+    POLL_SIGNAL,
+    POLL_TIMER,
+    POLL_CONTROL,
+    POLL_SEQUENCER,
+};
+
+/* Longest command accepted on the control FIFO. */
+#define CONTROL_LINE 1024
+
+/* Signals are read from a signalfd instead of interrupting whichever thread
+ * they land on, so they must be blocked before any thread is started. */
+static int setup_signals(void) {
+    sigset_t mask;
+    int fd;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL)) {
+        printf("Couldn't block signals: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-void update_pitch(struct dioxide *d);
-void write_sound(void *private, Uint8 *stream, int len);
+    fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (fd < 0) {
+        printf("Couldn't open signalfd: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-void setup_sound(struct dioxide *d) {
-    struct SDL_AudioSpec actual, *wanted = &d->spec;
-    double temp;
-    unsigned i;
+    return fd;
+}
 
-    wanted->freq = 48000;
-    wanted->format = AUDIO_S16;
-    wanted->channels = 1;
-    wanted->samples = 512;
-    wanted->callback = write_sound;
-    wanted->userdata = d;
+/* Opened read-write, so that it never sees EOF between writers. */
+static int setup_control(const char *path) {
+    int fd;
 
-    if (SDL_OpenAudio(wanted, &actual)) {
-        printf("Couldn't setup sound: %s\n", SDL_GetError());
+    if (mkfifo(path, 0600) && errno != EEXIST) {
+        printf("Couldn't make control FIFO %s: %s\n", path, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    printf("Opened sound for playback: Rate %d, format %d, samples %d\n",
-        actual.freq, actual.format, actual.samples);
-
-    wanted->freq = actual.freq;
-    wanted->format = actual.format;
-    wanted->samples = actual.samples;
+    fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        printf("Couldn't open control FIFO %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    d->inverse_sample_rate = 1.0 / actual.freq;
+    printf("Listening for commands on %s\n", path);
 
-    d->volume = 1.0;
+    return fd;
+}
 
-    d->attack_time = 0.001;
-    d->decay_time = 0.001;
-    d->release_time = 0.001;
+static int setup_timer(void) {
+    struct itimerspec second = { { 1, 0 }, { 1, 0 } };
+    int fd;
 
-    d->lpf_cutoff = d->spec.freq * 0.5;
-    d->lpf_resonance = 4.0;
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (fd < 0 || timerfd_settime(fd, 0, &second, NULL)) {
+        printf("Couldn't set up timerfd: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    frame_length = 1000 * 1000 * actual.samples / actual.freq;
+    return fd;
+}
 
-    printf("Initialized basic synth parameters, frame length is %d usec\n",
-        frame_length);
+/* Returns nonzero when it's time to quit. */
+static int handle_signal(struct dioxide *d, int fd) {
+    struct signalfd_siginfo info;
 
-    d->front_buffer = malloc(actual.samples * sizeof(float));
-    d->back_buffer = malloc(actual.samples * sizeof(float));
+    if (read(fd, &info, sizeof(info)) != sizeof(info)) {
+        return 0;
+    }
 
-    d->metal = &titanium;
+    switch (info.ssi_signo) {
+        case SIGUSR1:
+            dump_metrics(d, stdout);
+            return 0;
+        default:
+            printf("Caught %s, quitting.\n",
+                info.ssi_signo == SIGINT ? "SIGINT" : "SIGTERM");
+            return 1;
+    }
 }
 
-void close_sound(struct dioxide *d) {
-    SDL_PauseAudio(1);
-    SDL_CloseAudio();
-
-    free(d->front_buffer);
-    free(d->back_buffer);
-}
+static void handle_timer(struct dioxide *d, int fd,
+                         const char **metrics_path) {
+    uint64_t expirations;
 
-void write_sound(void *private, Uint8 *stream, int len) {
-    struct dioxide *d = private;
-    struct note *note, *prev_note;
-    double accumulator;
-    unsigned i, polyphony = 0;
-    int retval;
-    float *samples = d->front_buffer, *backburner = d->back_buffer, *ftemp;
-    signed short short_temp, *buf = (signed short*)stream;
-    struct timeval then, now;
-    unsigned long timediff;
-    struct ladspa_plugin *plugin = NULL;
-
-    gettimeofday(&then, NULL);
-
-    if (!d->notes->next) {
-        SDL_PauseAudio(1);
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
         return;
     }
 
-    for (prev_note = d->notes, note = prev_note->next; note; prev_note = note, note = note->next) {
-        if (note->adsr_volume == 0.0 && note->adsr_phase == ADSR_RELEASE) {
-            prev_note->next = note->next;
-            free(note);
-            note = prev_note;
-        }
+    if (*metrics_path && write_metrics(d, *metrics_path)) {
+        printf("Couldn't write metrics to %s\n", *metrics_path);
+        *metrics_path = NULL;
     }
 
-    if (!d->notes->next) {
-        SDL_PauseAudio(1);
-        return;
+    /* Free whatever graph the audio thread has finished fading out. */
+    reap_effects(d);
+}
+
+static void handle_command(struct dioxide *d, char *command) {
+    if (!strncmp(command, "effects ", 8)) {
+        swap_effects(d, command + 8);
+    } else if (*command) {
+        printf("Unknown command: %s\n", command);
     }
+}
 
-    /* Treat len and buf as counting shorts, not bytes.
-     * Avoids cognitive dissonance in later code. */
-    len /= 2;
+/* One command per line; a partial line waits in line for the rest. */
+static void handle_control(struct dioxide *d, int fd, char *line,
+                           unsigned *used) {
+    char *start, *end;
+    ssize_t count;
 
-    /* Update pitch only once per buffer. */
-    update_pitch(d);
+    count = read(fd, line + *used, CONTROL_LINE - 1 - *used);
+    if (count <= 0) {
+        return;
+    }
+    *used += count;
+    line[*used] = '\0';
+
+    start = line;
+    while ((end = strchr(start, '\n'))) {
+        *end = '\0';
+        handle_command(d, start);
+        start = end + 1;
+    }
 
-    memset(samples, 0, len * sizeof(float));
+    *used -= start - line;
+    memmove(line, start, *used);
 
-    for (note = d->notes->next; note; note = note->next) {
-        d->metal->generate(d, note, samples, len);
-        polyphony++;
+    if (*used == CONTROL_LINE - 1) {
+        printf("Control command too long; dropping it\n");
+        *used = 0;
     }
+}
 
-#if 0
-    printf("initialsamples = [\n");
-    for (i = 0; i < len; i++) {
-        printf("%f,\n", samples[i]);
-    }
-    printf("]\n");
-#endif
-    for (plugin = d->plugin_chain; plugin; plugin = plugin->next) {
-        /* Switch the names of the buffers, so that "samples" is always the
-         * buffer being rendered to. */
-        if (LADSPA_IS_INPLACE_BROKEN(plugin->desc->Properties)) {
-            ftemp = backburner;
-            backburner = samples;
-            samples = ftemp;
+static void run(struct dioxide *d, int signal_fd, int timer_fd,
+                int control_fd, const char *metrics_path) {
+    struct pollfd *fds;
+    char line[CONTROL_LINE];
+    unsigned used = 0;
+    int count, i, time_to_quit = 0;
+
+    count = snd_seq_poll_descriptors_count(d->seq, POLLIN);
+
+    fds = calloc(POLL_SEQUENCER + count, sizeof(struct pollfd));
+    fds[POLL_SIGNAL].fd = signal_fd;
+    fds[POLL_SIGNAL].events = POLLIN;
+    fds[POLL_TIMER].fd = timer_fd;
+    fds[POLL_TIMER].events = POLLIN;
+    /* poll() skips negative fds. */
+    fds[POLL_CONTROL].fd = control_fd;
+    fds[POLL_CONTROL].events = POLLIN;
+    count = snd_seq_poll_descriptors(d->seq, fds + POLL_SEQUENCER, count,
+        POLLIN);
 
-            plugin->desc->connect_port(plugin->handle,
-                plugin->input, backburner);
-        } else {
-            plugin->desc->connect_port(plugin->handle, plugin->input, samples);
-        }
+    while (!time_to_quit) {
+        if (poll(fds, POLL_SEQUENCER + count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
 
-        plugin->desc->connect_port(plugin->handle, plugin->output, samples);
-        plugin->desc->run(plugin->handle, len);
-#if 0
-        printf("samples = [\n");
-        for (i = 0; i < len; i++) {
-            printf("%f,\n", samples[i]);
+            printf("Couldn't poll: %s\n", strerror(errno));
+            break;
         }
-        printf("]\n");
-#endif
-    }
-
-    for (i = 0; i < len; i++) {
-        accumulator = samples[i];
 
-        accumulator *= d->volume * -32767;
+        for (i = POLL_SEQUENCER; i < POLL_SEQUENCER + count; i++) {
+            if (fds[i].revents) {
+                poll_sequencer(d);
+                break;
+            }
+        }
 
-        if (accumulator > 32767) {
-            accumulator = 32767;
-        } else if (accumulator < -32768) {
-            accumulator = -32768;
+        if (fds[POLL_TIMER].revents & POLLIN) {
+            handle_timer(d, timer_fd, &metrics_path);
         }
 
-        short_temp = (signed short)accumulator;
+        if (fds[POLL_CONTROL].revents & POLLIN) {
+            handle_control(d, control_fd, line, &used);
+        }
 
-        *buf = short_temp;
-        buf++;
+        if (fds[POLL_SIGNAL].revents & POLLIN) {
+            time_to_quit = handle_signal(d, signal_fd);
+        }
     }
 
-    gettimeofday(&now, NULL);
+    free(fds);
+}
 
-    while (now.tv_sec != then.tv_sec) {
-        now.tv_sec--;
-        now.tv_usec += 1000 * 1000;
-    }
+void usage(const char *name) {
+    printf("Usage: %s [-b backend] [-D device] [-P samples] [-n periods]\n",
+        name);
+    printf("       [-R rate] [-N channels] [-B samples] [-f config]\n");
+    printf("       [-j threads] [-m metrics] [-p voices] [-t trace]\n");
+    printf("       [-r priority] [-c cpu] [-M controller ...] [-L] [-S]\n");
+    printf("       [-e graph] [-C fifo] [-i input.mid -o output.wav] [-l]\n");
+    printf("  -B N     Samples per block: every period is rendered in blocks\n");
+    printf("           this long, which is also how often controls are\n");
+    printf("           updated (default 64)\n");
+    printf("  -b NAME  Sound output: sdl (default), or alsa to render\n");
+    printf("           straight into the ALSA PCM's mmap'd buffer\n");
+    printf("  -C FILE  Take commands from the FIFO FILE, making it if need be;\n");
+    printf("           \"effects GRAPH\" crossfades to a new effects graph\n");
+    printf("  -c N     Pin the audio thread to CPU N, with -r; workers go\n");
+    printf("           on the CPUs after it\n");
+    printf("  -f FILE  Read \"name = value\" settings from FILE: rate,\n");
+    printf("           channels, period, periods and block; the command line\n");
+    printf("           wins (default $XDG_CONFIG_HOME/dioxide.conf)\n");
+    printf("  -D NAME  ALSA PCM to play on (default \"default\"); try null\n");
+    printf("  -P N     Samples per device period (default 512)\n");
+    printf("  -l       List the LADSPA plugins found along LADSPA_PATH, and\n");
+    printf("           exit\n");
+    printf("  -L       Use installed LADSPA plugins instead of the built-in\n");
+    printf("           chorus, phaser and low-pass filter\n");
+    printf("  -M NAME  Connect to every MIDI controller whose name contains\n");
+    printf("           NAME, whenever it appears; may be repeated, up to\n");
+    printf("           %d times (default \"Oxygen 61\")\n", MAX_CONTROLLERS);
+    printf("  -N N     Output channels, at most %d, all playing the same\n",
+        MAX_CHANNELS);
+    printf("           sound (default 1)\n");
+    printf("  -n N     Periods in the ALSA ring buffer (default 2)\n");
+    printf("  -e GRAPH Effects, as LADSPA IDs or labels: \">\" chains them, and\n");
+    printf("           \"(a | b*0.5)\" mixes branches fed the same signal;\n");
+    printf("           \"dry\" is the signal itself, and \"ID[port=value]\"\n");
+    printf("           sets a control (default \"%s\")\n", DEFAULT_EFFECTS);
+    printf("  -i FILE  Render a Standard MIDI File offline instead of\n");
+    printf("           playing live; requires -o\n");
+    printf("  -j N     Worker threads rendering voices alongside the audio\n");
+    printf("           thread, at most %d (default 0)\n", MAX_THREADS);
+    printf("  -m FILE  Rewrite FILE with realtime metrics every second;\n");
+    printf("           SIGUSR1 prints them regardless\n");
+    printf("  -o FILE  WAV file to write the offline render to\n");
+    printf("  -p N     Size of the voice pool, at most %d (default %d);\n",
+        MAX_VOICES, MAX_VOICES);
+    printf("           past that, new notes steal the quietest voice\n");
+    printf("  -R N     Sample rate to ask the device for (default 48000)\n");
+    printf("  -r N     Lock and prefault memory, and render at SCHED_FIFO\n");
+    printf("           priority N (1 to 99); anything not permitted is\n");
+    printf("           skipped with a warning\n");
+    printf("  -S       Run the effects on a thread of their own, a block\n");
+    printf("           behind the voices; adds a block of latency\n");
+    printf("  -t FILE  Trace every render stage and sequencer event to\n");
+    printf("           FILE, for chrome://tracing or Perfetto\n");
+}
 
-    timediff = now.tv_usec - then.tv_usec;
+int main(int argc, char **argv) {
+    struct dioxide *d = calloc(1, sizeof(struct dioxide));
+    const char *midi_path = NULL, *wav_path = NULL, *metrics_path = NULL;
+    const char *trace_path = NULL, *control_path = NULL, *config_path = NULL;
+    int opt, retval, signal_fd = -1, timer_fd, control_fd = -1;
 
-    if (timediff > frame_length) {
-        printf("Long frame: %d usec\n", timediff);
+    if (!d) {
+        exit(EXIT_FAILURE);
     }
-}
 
-void update_pitch(struct dioxide *d) {
-    struct note *note = d->notes->next;
-    double midi, bend, target_pitch, ratio;
+    d->rt_cpu = -1;
 
-    while (note) {
-        switch (d->pitch_wheel_config) {
-            case WHEEL_TRADITIONAL:
-                bend = d->pitch_bend * (2.0 / 8192.0);
-                break;
-            case WHEEL_RUDESS:
-                /* Split the pitch wheel into an upper and lower range. */
-                if (d->pitch_bend >= 0) {
-                    bend = d->pitch_bend * (2.0 / 8192.0);
+    while ((opt = getopt(argc, argv,
+                "B:b:C:c:D:e:f:hi:j:lLm:M:N:n:o:p:P:R:r:St:")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (!strcmp(optarg, sdl_backend.name)) {
+                    d->backend = &sdl_backend;
+                } else if (!strcmp(optarg, alsa_backend.name)) {
+                    d->backend = &alsa_backend;
                 } else {
-                    bend = d->pitch_bend * (12.0 / 8192.0);
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
                 }
                 break;
-            case WHEEL_DIVEBOMB:
-                if (d->pitch_bend >= 0) {
-                    bend = d->pitch_bend * (24.0 / 8192.0);
-                } else {
-                    bend = d->pitch_bend * (36.0 / 8192.0);
+            case 'B':
+                if (set_setting(d, "block", optarg)) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
                 }
                 break;
+            case 'C':
+                control_path = optarg;
+                break;
+            case 'c':
+                d->rt_cpu = strtol(optarg, NULL, 0);
+                if (d->rt_cpu < 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'D':
+                d->device = optarg;
+                break;
+            case 'e':
+                d->effects_graph = optarg;
+                break;
+            case 'f':
+                config_path = optarg;
+                break;
+            case 'i':
+                midi_path = optarg;
+                break;
+            case 'j':
+                d->threads = strtoul(optarg, NULL, 0);
+                if (d->threads > MAX_THREADS) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                setup_catalog(d);
+                list_catalog(d, stdout);
+                cleanup_catalog(d);
+                free(d);
+                exit(EXIT_SUCCESS);
+            case 'L':
+                d->prefer_ladspa = 1;
+                break;
+            case 'm':
+                metrics_path = optarg;
+                break;
+            case 'M':
+                if (d->controller_count == MAX_CONTROLLERS) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                d->controllers[d->controller_count++] = optarg;
+                break;
+            case 'N':
+                if (set_setting(d, "channels", optarg)) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                if (set_setting(d, "periods", optarg)) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'o':
+                wav_path = optarg;
+                break;
+            case 'P':
+                if (set_setting(d, "period", optarg)) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                d->max_voices = strtoul(optarg, NULL, 0);
+                if (!d->max_voices || d->max_voices > MAX_VOICES) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                d->rt_priority = strtol(optarg, NULL, 0);
+                if (d->rt_priority < 1 || d->rt_priority > 99) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'R':
+                if (set_setting(d, "rate", optarg)) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                d->pipelined = 1;
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
         }
+    }
 
-        midi = note->note + bend;
+    if (!d->backend) {
+        d->backend = &sdl_backend;
+    }
+    if (load_config(d, config_path)) {
+        exit(EXIT_FAILURE);
+    }
+    default_settings(d);
 
-        note->pitch = 440 * pow(2, (midi - 69.0) / 12.0);
-        note = note->next;
+    if (!midi_path != !wav_path) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
     }
-}
 
-int main() {
-    struct dioxide *d = calloc(1, sizeof(struct dioxide));
-    d->notes = calloc(1, sizeof(struct note));
-    struct itimerval timer;
-    int retval;
+    if (!midi_path) {
+        signal_fd = setup_signals();
+    }
 
-    signal(SIGINT, handle_sigint);
+    /* Before any rendering thread starts. */
+    if (trace_path) {
+        setup_trace(d, trace_path);
+    }
 
-    if (!d) {
-        exit(EXIT_FAILURE);
+    if (midi_path) {
+        /* No sound card or sequencer is touched in offline mode. */
+        setup_engine(d, d->sample_rate, d->channels, d->period_size);
+        setup_plugins(d);
+
+        retval = render_offline(d, midi_path, wav_path);
+
+        /* The effects thread may still be on the last block. */
+        close_engine(d);
+        cleanup_plugins(d);
+        cleanup_trace(d);
+
+        free(d);
+        exit(retval);
     }
 
+    setup_realtime(d);
+
     /* Sound must be set up before plugins, to obtain sample rate. */
-    setup_sound(d);
+    d->backend->setup(d);
     setup_plugins(d);
-    hook_plugins(d);
     setup_sequencer(d);
+    lock_memory(d);
 
-    SDL_PauseAudio(1);
+    timer_fd = setup_timer();
+    if (control_path) {
+        control_fd = setup_control(control_path);
+    }
 
-    while (!time_to_quit) {
-        poll_sequencer(d);
+    run(d, signal_fd, timer_fd, control_fd, metrics_path);
 
-        if (!d->connected) {
-            solicit_connections(d);
-        }
+    if (control_fd >= 0) {
+        close(control_fd);
     }
+    close(timer_fd);
+    close(signal_fd);
+
+    dump_metrics(d, stdout);
 
-    close_sound(d);
+    d->backend->close(d);
+    cleanup_trace(d);
     cleanup_plugins(d);
 
     retval = snd_seq_close(d->seq);
 
-    free(d->notes);
     free(d);
     exit(retval);
 }
@@ -0,0 +1,134 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dioxide.h"
+
+/* Health counters for the audio thread. Recording is a handful of relaxed
+ * atomic adds, with no locks, allocation or system calls beyond reading
+ * the clock; dumping them is left to whoever wants to look, on another
+ * thread. */
+
+/* start is when the callback began, on the event clock. */
+void record_callback(struct dioxide *d, unsigned long long start,
+                     unsigned len) {
+    struct metrics *m = &d->metrics;
+    unsigned long long elapsed, budget, ratio, worst;
+    unsigned bucket = 0;
+
+    elapsed = event_clock() - start;
+    budget = 1000000000ULL * len / d->rate;
+
+    /* In 1024ths of the budget; the bucket is its bit length. */
+    ratio = budget ? (elapsed << 10) / budget : 0;
+    if (ratio) {
+        bucket = 64 - __builtin_clzll(ratio);
+    }
+    if (bucket >= METRIC_BUCKETS) {
+        bucket = METRIC_BUCKETS - 1;
+    }
+
+    atomic_fetch_add_explicit(&m->callbacks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->total_ns, elapsed, memory_order_relaxed);
+
+    if (elapsed > budget) {
+        atomic_fetch_add_explicit(&m->misses, 1, memory_order_relaxed);
+    }
+
+    /* Only the audio thread writes these two, so no compare-and-swap. */
+    worst = atomic_load_explicit(&m->worst_ns, memory_order_relaxed);
+    if (elapsed > worst) {
+        atomic_store_explicit(&m->worst_ns, elapsed, memory_order_relaxed);
+    }
+}
+
+void record_xrun(struct dioxide *d) {
+    atomic_fetch_add_explicit(&d->metrics.xruns, 1, memory_order_relaxed);
+}
+
+void record_polyphony(struct dioxide *d, unsigned polyphony) {
+    struct metrics *m = &d->metrics;
+
+    if (polyphony > atomic_load_explicit(&m->peak_polyphony,
+            memory_order_relaxed)) {
+        atomic_store_explicit(&m->peak_polyphony, polyphony,
+            memory_order_relaxed);
+    }
+}
+
+static double percent(unsigned long long part, unsigned long long whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+/* The counters are read one at a time while the audio thread carries on,
+ * so they may disagree slightly with each other. */
+void dump_metrics(struct dioxide *d, FILE *f) {
+    struct metrics *m = &d->metrics;
+    unsigned long callbacks, count;
+    unsigned long long total, ns;
+    unsigned i;
+    char label[32];
+
+    callbacks = atomic_load(&m->callbacks);
+    total = atomic_load(&m->total_ns);
+
+    fprintf(f, "Callbacks: %lu, deadline misses: %lu, xruns: %lu\n",
+        callbacks, atomic_load(&m->misses), atomic_load(&m->xruns));
+    fprintf(f, "Worst callback: %.1f usec, mean %.1f usec\n",
+        atomic_load(&m->worst_ns) / 1000.0,
+        callbacks ? total / 1000.0 / callbacks : 0.0);
+    fprintf(f, "Peak polyphony: %u\n", atomic_load(&m->peak_polyphony));
+
+    fprintf(f, "Callback duration, as a share of the buffer's length:\n");
+    for (i = 0; i < METRIC_BUCKETS; i++) {
+        count = atomic_load(&m->buckets[i]);
+        if (!count) {
+            continue;
+        }
+
+        /* Bucket i starts at 2^(i - METRIC_UNITY) of the buffer. */
+        if (!i) {
+            snprintf(label, sizeof(label), "under %.2g%%",
+                ldexp(100, 1 - METRIC_UNITY));
+        } else if (i == METRIC_BUCKETS - 1) {
+            snprintf(label, sizeof(label), "%.2g%% and over",
+                ldexp(100, i - METRIC_UNITY));
+        } else {
+            snprintf(label, sizeof(label), "%.2g%% to %.2g%%",
+                ldexp(100, i - METRIC_UNITY),
+                ldexp(100, i + 1 - METRIC_UNITY));
+        }
+
+        fprintf(f, "  %-22s %10lu\n", label, count);
+    }
+
+    fprintf(f, "Render time:\n");
+    for (i = 0; elements[i]; i++) {
+        ns = atomic_load(&elements[i]->render_ns);
+        fprintf(f, "  %-9s %10.1f msec %5.1f%%\n", elements[i]->name,
+            ns / 1e6, percent(ns, total));
+    }
+    ns = atomic_load(&m->effects_ns);
+    fprintf(f, "  %-9s %10.1f msec %5.1f%%\n", "effects", ns / 1e6,
+        percent(ns, total));
+}
+
+/* Replace path with a fresh dump, atomically, so readers never see half
+ * of one. */
+int write_metrics(struct dioxide *d, const char *path) {
+    char temporary[4096];
+    FILE *f;
+
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+    f = fopen(temporary, "w");
+    if (!f) {
+        return -1;
+    }
+
+    dump_metrics(d, f);
+    fclose(f);
+
+    return rename(temporary, path);
+}
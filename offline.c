@@ -0,0 +1,489 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dioxide.h"
+
+/* Offline rendering: read a Standard MIDI File, feed its events through the
+ * same handlers as the live sequencer, and write 16-bit WAV as fast as the
+ * CPU allows. The event clock is the song position, so events land on the
+ * exact sample the file puts them at. */
+
+/* Seconds of release and effect tail allowed after the song ends. */
+#define MAX_TAIL 5
+
+struct midi_event {
+    unsigned long tick;
+    unsigned order;
+
+    unsigned char status;
+    unsigned char data[2];
+
+    /* Microseconds per quarter note, for tempo changes. */
+    unsigned long tempo;
+};
+
+struct midi_file {
+    unsigned division;
+    int smpte;
+
+    struct midi_event *events;
+    unsigned count, size;
+};
+
+static unsigned long read_be(const unsigned char *p, unsigned bytes) {
+    unsigned long l = 0;
+
+    while (bytes--) {
+        l = (l << 8) | *p++;
+    }
+
+    return l;
+}
+
+static int read_vlq(const unsigned char **p, const unsigned char *end,
+                    unsigned long *value) {
+    unsigned long l = 0;
+    unsigned i;
+
+    for (i = 0; i < 4; i++) {
+        if (*p >= end) {
+            return -1;
+        }
+
+        l = (l << 7) | (**p & 0x7f);
+
+        if (!(*(*p)++ & 0x80)) {
+            *value = l;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static struct midi_event* push_event(struct midi_file *mf) {
+    struct midi_event *event;
+
+    if (mf->count == mf->size) {
+        mf->size = mf->size ? mf->size * 2 : 256;
+        mf->events = realloc(mf->events,
+            mf->size * sizeof(struct midi_event));
+    }
+
+    event = &mf->events[mf->count];
+    memset(event, 0, sizeof(struct midi_event));
+    event->order = mf->count++;
+
+    return event;
+}
+
+static int parse_track(struct midi_file *mf, const unsigned char *p,
+                       const unsigned char *end) {
+    struct midi_event *event;
+    unsigned long tick = 0, delta, length;
+    unsigned char status = 0, type;
+
+    while (p < end) {
+        if (read_vlq(&p, end, &delta)) {
+            return -1;
+        }
+        tick += delta;
+
+        if (p >= end) {
+            return -1;
+        }
+
+        if (*p & 0x80) {
+            status = *p++;
+        } else if (!status) {
+            /* Running status without a previous status byte. */
+            return -1;
+        }
+
+        if (status == 0xff) {
+            if (p >= end) {
+                return -1;
+            }
+            type = *p++;
+
+            if (read_vlq(&p, end, &length) || length > end - p) {
+                return -1;
+            }
+
+            if (type == 0x2f) {
+                /* End of track. */
+                return 0;
+            } else if (type == 0x51 && length == 3) {
+                event = push_event(mf);
+                event->tick = tick;
+                event->status = status;
+                event->tempo = read_be(p, 3);
+            }
+
+            p += length;
+            /* Meta events cancel running status. */
+            status = 0;
+        } else if (status == 0xf0 || status == 0xf7) {
+            if (read_vlq(&p, end, &length) || length > end - p) {
+                return -1;
+            }
+
+            p += length;
+            status = 0;
+        } else {
+            event = push_event(mf);
+            event->tick = tick;
+            event->status = status;
+
+            switch (status & 0xf0) {
+                case 0xc0:
+                case 0xd0:
+                    if (p + 1 > end) {
+                        return -1;
+                    }
+                    event->data[0] = *p++;
+                    break;
+                default:
+                    if (p + 2 > end) {
+                        return -1;
+                    }
+                    event->data[0] = *p++;
+                    event->data[1] = *p++;
+                    break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int compare_events(const void *a, const void *b) {
+    const struct midi_event *first = a, *second = b;
+
+    if (first->tick != second->tick) {
+        return first->tick < second->tick ? -1 : 1;
+    }
+
+    return first->order < second->order ? -1 : first->order > second->order;
+}
+
+static int load_midi_file(struct midi_file *mf, const char *path) {
+    FILE *f;
+    unsigned char *data, *p, *end;
+    unsigned long size, length;
+    unsigned tracks, division;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        printf("Couldn't open MIDI file %s\n", path);
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    data = malloc(size);
+    if (!data || fread(data, 1, size, f) != size) {
+        printf("Couldn't read MIDI file %s\n", path);
+        free(data);
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+
+    p = data;
+    end = data + size;
+
+    if (size < 14 || memcmp(p, "MThd", 4) || read_be(p + 4, 4) < 6) {
+        printf("%s is not a Standard MIDI File\n", path);
+        free(data);
+        return -1;
+    }
+
+    tracks = read_be(p + 10, 2);
+    division = read_be(p + 12, 2);
+
+    if (division & 0x8000) {
+        /* SMPTE: frames per second times ticks per frame. */
+        mf->smpte = 1;
+        mf->division = (256 - (division >> 8)) * (division & 0xff);
+    } else {
+        mf->division = division;
+    }
+
+    if (!mf->division) {
+        printf("%s has a zero time division\n", path);
+        free(data);
+        return -1;
+    }
+
+    p += 8 + read_be(p + 4, 4);
+
+    while (tracks && p + 8 <= end) {
+        length = read_be(p + 4, 4);
+
+        if (length > end - p - 8) {
+            printf("Truncated track in %s\n", path);
+            break;
+        }
+
+        /* Unknown chunks are skipped, per the spec. */
+        if (!memcmp(p, "MTrk", 4)) {
+            if (parse_track(mf, p + 8, p + 8 + length)) {
+                printf("Malformed track in %s\n", path);
+            }
+            tracks--;
+        }
+
+        p += 8 + length;
+    }
+
+    free(data);
+
+    qsort(mf->events, mf->count, sizeof(struct midi_event), compare_events);
+
+    return 0;
+}
+
+/* Returns nonzero for messages the synth has no use for, which are left
+ * out rather than sent through handle_event(). */
+static int translate_event(struct midi_event *midi, snd_seq_event_t *event) {
+    memset(event, 0, sizeof(snd_seq_event_t));
+
+    switch (midi->status & 0xf0) {
+        case 0x80:
+            event->type = SND_SEQ_EVENT_NOTEOFF;
+            event->data.note.note = midi->data[0];
+            event->data.note.velocity = midi->data[1];
+            break;
+        case 0x90:
+            /* Velocity zero is the usual shorthand for note off. */
+            event->type = midi->data[1] ?
+                SND_SEQ_EVENT_NOTEON : SND_SEQ_EVENT_NOTEOFF;
+            event->data.note.note = midi->data[0];
+            event->data.note.velocity = midi->data[1];
+            break;
+        case 0xb0:
+            event->type = SND_SEQ_EVENT_CONTROLLER;
+            event->data.control.param = midi->data[0];
+            event->data.control.value = midi->data[1];
+            break;
+        case 0xc0:
+            event->type = SND_SEQ_EVENT_PGMCHANGE;
+            event->data.control.value = midi->data[0];
+            break;
+        case 0xe0:
+            event->type = SND_SEQ_EVENT_PITCHBEND;
+            event->data.control.value =
+                ((midi->data[1] << 7) | midi->data[0]) - 8192;
+            break;
+        default:
+            /* Aftertouch and friends aren't handled by the synth. */
+            return -1;
+    }
+
+    event->data.note.channel = midi->status & 0x0f;
+
+    return 0;
+}
+
+static void write_le(FILE *f, unsigned long value, unsigned bytes) {
+    while (bytes--) {
+        fputc(value & 0xff, f);
+        value >>= 8;
+    }
+}
+
+static void write_wav_header(FILE *f, unsigned rate, unsigned channels,
+                             unsigned long frames) {
+    unsigned long data_size = frames * channels * sizeof(signed short);
+
+    fwrite("RIFF", 1, 4, f);
+    write_le(f, 36 + data_size, 4);
+    fwrite("WAVE", 1, 4, f);
+
+    fwrite("fmt ", 1, 4, f);
+    write_le(f, 16, 4);
+    /* PCM, 16 bits. */
+    write_le(f, 1, 2);
+    write_le(f, channels, 2);
+    write_le(f, rate, 4);
+    write_le(f, rate * channels * sizeof(signed short), 4);
+    write_le(f, channels * sizeof(signed short), 2);
+    write_le(f, 16, 2);
+
+    fwrite("data", 1, 4, f);
+    write_le(f, data_size, 4);
+}
+
+static void write_wav_samples(FILE *f, signed short *buf, unsigned len) {
+    unsigned i;
+
+    for (i = 0; i < len; i++) {
+        write_le(f, (unsigned short)buf[i], 2);
+    }
+}
+
+/* Song position in nanoseconds, for the event clock. */
+static unsigned long long frame_time(struct dioxide *d, double frame) {
+    return frame * 1e9 / d->rate;
+}
+
+static double elapsed(struct timespec *then) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - then->tv_sec) + (now.tv_nsec - then->tv_nsec) * 1e-9;
+}
+
+/* The event queue is full, and an event at event_frame still has to go in.
+ * Render up to the start of the block it lands in, which applies everything
+ * queued before it; if that's the very next block, apply the oldest queued
+ * event straight away instead. Either way, nothing is dropped. */
+static void make_room(struct dioxide *d, FILE *f, signed short *buf,
+                      double event_frame, unsigned long *frames,
+                      unsigned long long *voice_samples) {
+    unsigned long target = (unsigned long)event_frame / d->samples *
+        d->samples;
+    unsigned n, polyphony;
+
+    if (target <= *frames + d->carried) {
+        apply_oldest_event(d);
+        return;
+    }
+
+    while (*frames < target) {
+        n = target - *frames < d->period ? target - *frames : d->period;
+        polyphony = render(d, buf, n, frame_time(d, *frames));
+
+        write_wav_samples(f, buf, n * d->channels);
+        *frames += n;
+        *voice_samples += (unsigned long long)polyphony * n;
+    }
+}
+
+int render_offline(struct dioxide *d, const char *midi_path,
+                   const char *wav_path) {
+    struct midi_file mf = { 0 };
+    struct midi_event *midi;
+    snd_seq_event_t event;
+    FILE *f;
+    signed short *buf;
+    unsigned i = 0, len = d->period, polyphony, note;
+    unsigned long frames = 0, last_tick = 0, tempo = 500000, ended = 0;
+    int over = 0;
+    unsigned long long voice_samples = 0;
+    double seconds = 0, event_frame, render_time;
+    struct timespec then;
+
+    if (load_midi_file(&mf, midi_path)) {
+        return EXIT_FAILURE;
+    }
+
+    printf("Loaded %u events from %s\n", mf.count, midi_path);
+
+    f = fopen(wav_path, "wb");
+    if (!f) {
+        printf("Couldn't open WAV file %s\n", wav_path);
+        free(mf.events);
+        return EXIT_FAILURE;
+    }
+
+    buf = malloc(len * d->channels * sizeof(signed short));
+
+    /* Placeholder; rewritten once the length is known. */
+    write_wav_header(f, d->rate, d->channels, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &then);
+
+    for (;;) {
+        /* Queue every event that lands inside this buffer, or inside the
+         * block render() may run on past its end; render() splits its
+         * blocks at each of them. */
+        while (i < mf.count) {
+            midi = &mf.events[i];
+
+            if (mf.smpte) {
+                event_frame = (double)midi->tick / mf.division;
+            } else {
+                event_frame = seconds + (double)(midi->tick - last_tick)
+                    * tempo / mf.division * 1e-6;
+            }
+            event_frame *= d->rate;
+
+            if (event_frame >= frames + len + d->samples) {
+                break;
+            }
+
+            if (!mf.smpte) {
+                seconds = event_frame / d->rate;
+                last_tick = midi->tick;
+            }
+
+            if (midi->status == 0xff) {
+                tempo = midi->tempo;
+            } else if (!translate_event(midi, &event)) {
+                while (queue_full(&d->events)) {
+                    make_room(d, f, buf, event_frame, &frames,
+                        &voice_samples);
+                }
+                handle_event(d, &event, frame_time(d, event_frame));
+            }
+
+            i++;
+        }
+
+        /* Once the song is over and every event has been applied, let go
+         * of any notes it left held. This is the audio thread too, so the
+         * voices can be released directly. */
+        if (i == mf.count && !over && !queue_pending(&d->events)) {
+            over = 1;
+            ended = frames;
+
+            for (note = 0; note < MIDI_NOTES; note++) {
+                if (d->voices.index[note] >= 0) {
+                    voice_off(d, note);
+                }
+            }
+        }
+
+        polyphony = render(d, buf, len, frame_time(d, frames));
+
+        /* Stop once the song is over, and every release and effect tail
+         * has finished, or has gone on for too long to be a tail. */
+        if (i == mf.count && !polyphony && !render_ringing(d)) {
+            break;
+        }
+
+        if (over && frames - ended >= (unsigned long)d->rate * MAX_TAIL) {
+            printf("Still sounding %d sec after the end; cutting it off\n",
+                MAX_TAIL);
+            break;
+        }
+
+        write_wav_samples(f, buf, len * d->channels);
+        frames += len;
+        voice_samples += (unsigned long long)polyphony * len;
+    }
+
+    render_time = elapsed(&then);
+
+    fseek(f, 0, SEEK_SET);
+    write_wav_header(f, d->rate, d->channels, frames);
+    fclose(f);
+
+    free(buf);
+    free(mf.events);
+
+    printf("Rendered %.2f sec of audio in %.3f sec (%.1fx realtime)\n",
+        (double)frames / d->rate, render_time,
+        (double)frames / d->rate / render_time);
+    printf("Throughput: %.0f voice-samples/sec\n",
+        voice_samples / render_time);
+
+    return EXIT_SUCCESS;
+}
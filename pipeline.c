@@ -0,0 +1,210 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "dioxide.h"
+
+/* An optional two-stage pipeline: the audio thread renders the voices of
+ * each block and hands them to an effects thread, which runs the effects
+ * and converts the result while the audio thread gets on with the voices of
+ * the next block. Each block then only has to wait for whichever of the
+ * two stages is slower, not their sum, for exactly one block more of
+ * latency.
+ *
+ * Blocks go back and forth through two slots, with a counter each way;
+ * the audio thread fills one slot while the effects thread works on the
+ * other. Either side sleeps on a futex once it runs out of work, and the
+ * other only makes a system call to wake it if it's actually asleep. */
+
+struct slot {
+    float *dry;
+    signed short *wet;
+    unsigned len;
+    unsigned polyphony;
+    /* The knobs as the block was submitted. */
+    struct knobs knobs;
+};
+
+struct pipeline {
+    struct dioxide *d;
+    pthread_t thread;
+
+    struct slot slots[2];
+
+    /* Blocks handed to the effects thread, and blocks it has finished,
+     * ever; slot n & 1 holds block n. */
+    _Alignas(64) atomic_uint submitted;
+    _Alignas(64) atomic_uint finished;
+    atomic_int effects_asleep;
+    atomic_int audio_asleep;
+    atomic_int quit;
+
+    /* Whether the effects were still ringing after the last block. */
+    atomic_int ringing;
+
+    /* Audio thread only: the next block it will submit. */
+    unsigned next;
+};
+
+static void* run(void *private) {
+    struct pipeline *p = private;
+    struct dioxide *d = p->d;
+    struct slot *slot;
+    unsigned n = 0;
+
+    make_realtime(d, "effects",
+        d->rt_cpu >= 0 ? d->rt_cpu + (int)d->threads + 1 : -1);
+
+    for (;;) {
+        /* Paired with the audio thread bumping submitted and then checking
+         * effects_asleep. */
+        while (atomic_load_explicit(&p->submitted, memory_order_acquire) ==
+               n && !atomic_load(&p->quit)) {
+            atomic_store(&p->effects_asleep, 1);
+            if (atomic_load(&p->submitted) == n && !atomic_load(&p->quit)) {
+                futex_wait(&p->submitted, n);
+            }
+            atomic_store(&p->effects_asleep, 0);
+        }
+
+        if (atomic_load(&p->quit)) {
+            break;
+        }
+
+        slot = &p->slots[n & 1];
+
+        memcpy(d->front_buffer, slot->dry, slot->len * sizeof(float));
+        d->effects_knobs = slot->knobs;
+        finish_block(d, slot->wet, slot->len, slot->polyphony,
+            TRACE_EFFECTS);
+
+        atomic_store_explicit(&p->ringing, effects_ringing(d),
+            memory_order_relaxed);
+
+        n++;
+        atomic_store_explicit(&p->finished, n, memory_order_release);
+
+        /* Lest the check below be ordered before the store above, missing
+         * the audio thread going to sleep. */
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load(&p->audio_asleep)) {
+            futex_wake(&p->finished);
+        }
+    }
+
+    return NULL;
+}
+
+/* Wait for every block submitted so far to come back. */
+static void wait_finished(struct pipeline *p) {
+    unsigned finished;
+    struct spin spin;
+
+    start_spin(&spin);
+
+    while ((finished = atomic_load_explicit(&p->finished,
+                memory_order_acquire)) != p->next) {
+        if (spinning(&spin)) {
+            continue;
+        }
+
+        atomic_store(&p->audio_asleep, 1);
+        if (atomic_load(&p->finished) == finished) {
+            futex_wait(&p->finished, finished);
+        }
+        atomic_store(&p->audio_asleep, 0);
+    }
+}
+
+/* Render the voices of a block of len samples starting at time, and fill
+ * buf with the block before it after its effects; blocks are all the same
+ * length, and the first comes out silent. Returns the most voices in
+ * either block. */
+unsigned render_pipelined(struct dioxide *d, signed short *buf, unsigned len,
+                          unsigned long long time) {
+    struct pipeline *p = d->pipeline;
+    struct slot *slot = &p->slots[p->next & 1], *last;
+    unsigned long long span;
+    unsigned polyphony;
+
+    slot->polyphony = render_voices_only(d, slot->dry, len, time);
+    slot->len = len;
+    slot->knobs = d->knobs;
+
+    span = trace_clock(d);
+    wait_finished(p);
+    trace_span(d, 0, "pipeline", "wait", len, span);
+
+    last = &p->slots[(p->next - 1) & 1];
+    memcpy(buf, last->wet, len * sizeof(signed short));
+
+    polyphony = slot->polyphony > last->polyphony ?
+        slot->polyphony : last->polyphony;
+
+    p->next++;
+    atomic_store_explicit(&p->submitted, p->next, memory_order_release);
+
+    /* As in run(). */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&p->effects_asleep)) {
+        futex_wake(&p->submitted);
+    }
+
+    return polyphony;
+}
+
+/* Whether the effects of the last finished block left a tail ringing.
+ * The block still in flight can't have started one if it had no voices. */
+int pipeline_ringing(struct dioxide *d) {
+    return atomic_load_explicit(&d->pipeline->ringing, memory_order_relaxed);
+}
+
+/* With the engine, if d->pipelined was asked for. */
+void setup_pipeline(struct dioxide *d) {
+    struct pipeline *p;
+    unsigned i;
+    int retval;
+
+    if (!d->pipelined) {
+        return;
+    }
+
+    p = calloc(1, sizeof(struct pipeline));
+    p->d = d;
+
+    for (i = 0; i < 2; i++) {
+        p->slots[i].dry = calloc(d->samples, sizeof(float));
+        p->slots[i].wet = calloc(d->samples, sizeof(signed short));
+    }
+
+    retval = pthread_create(&p->thread, NULL, run, p);
+    if (retval) {
+        printf("Couldn't start effects thread: %s\n", strerror(retval));
+        exit(EXIT_FAILURE);
+    }
+
+    d->pipeline = p;
+
+    printf("Running effects on their own thread, %u samples behind\n",
+        d->samples);
+}
+
+void cleanup_pipeline(struct dioxide *d) {
+    struct pipeline *p = d->pipeline;
+    unsigned i;
+
+    if (!p) {
+        return;
+    }
+
+    atomic_store(&p->quit, 1);
+    futex_wake(&p->submitted);
+    pthread_join(p->thread, NULL);
+
+    for (i = 0; i < 2; i++) {
+        free(p->slots[i].dry);
+        free(p->slots[i].wet);
+    }
+
+    free(p);
+    d->pipeline = NULL;
+}
@@ -0,0 +1,89 @@
+#include <time.h>
+
+#include "dioxide.h"
+
+/* Wait-free single-producer, single-consumer ring. The sequencer thread
+ * only ever moves head, and the audio thread only ever moves tail; each
+ * publishes its slot with a release store that the other side acquires. */
+
+void setup_queue(struct event_queue *q) {
+    atomic_store_explicit(&q->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&q->tail, 0, memory_order_relaxed);
+    q->dropped = 0;
+}
+
+/* Producer side. Returns nonzero if the ring was full and the event was
+ * dropped. */
+int queue_push(struct event_queue *q, const struct event *event) {
+    unsigned head, tail;
+
+    head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if (head - tail == EVENT_QUEUE_SIZE) {
+        q->dropped++;
+        return -1;
+    }
+
+    q->events[head & (EVENT_QUEUE_SIZE - 1)] = *event;
+
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+    return 0;
+}
+
+/* Consumer side. Like queue_pop(), but leaves the event queued. */
+int queue_peek(struct event_queue *q, struct event *event) {
+    unsigned head, tail;
+
+    tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+    if (head == tail) {
+        return -1;
+    }
+
+    *event = q->events[tail & (EVENT_QUEUE_SIZE - 1)];
+
+    return 0;
+}
+
+/* Consumer side. Returns nonzero if there was nothing to pop. */
+int queue_pop(struct event_queue *q, struct event *event) {
+    unsigned head, tail;
+
+    tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+    if (head == tail) {
+        return -1;
+    }
+
+    *event = q->events[tail & (EVENT_QUEUE_SIZE - 1)];
+
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+    return 0;
+}
+
+/* Either side; only a hint, since the other side may move at any time. */
+int queue_pending(struct event_queue *q) {
+    return atomic_load_explicit(&q->head, memory_order_acquire) !=
+        atomic_load_explicit(&q->tail, memory_order_acquire);
+}
+
+/* Producer side: whether queue_push() would drop an event now. */
+int queue_full(struct event_queue *q) {
+    return atomic_load_explicit(&q->head, memory_order_relaxed) -
+        atomic_load_explicit(&q->tail, memory_order_acquire) ==
+        EVENT_QUEUE_SIZE;
+}
+
+/* The event clock: CLOCK_MONOTONIC, in nanoseconds. */
+unsigned long long event_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dioxide.h"
+
+/* Keeping the render path away from the rest of the OS (-r): memory locked
+ * and prefaulted, so that no render ever waits on a page fault, and the
+ * threads that render on SCHED_FIFO, optionally pinned. Every step that
+ * isn't permitted is reported once and skipped; dioxide still runs, just
+ * without the guarantee. */
+
+/* Stack that each realtime thread touches up front. Renders use a few
+ * hundred bytes of stack, plugins and libm a little more. */
+#define PREFAULT_STACK (64 * 1024)
+
+/* Before anything is allocated: keep freed memory in the heap, and large
+ * blocks out of mmap, so that nothing is handed back to the kernel and
+ * faulted in all over again later. */
+void setup_realtime(struct dioxide *d) {
+    if (!d->rt_priority) {
+        return;
+    }
+
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+}
+
+/* Once the engine, plugins and sequencer are set up: lock every page that
+ * exists now or will later. Locking faults everything in as it goes. */
+void lock_memory(struct dioxide *d) {
+    if (!d->rt_priority) {
+        return;
+    }
+
+    /* In case locking isn't allowed, at least touch what render() will. */
+    memset(d->front_buffer, 0, d->samples * sizeof(float));
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        printf("Couldn't lock memory: %s; page faults may cause dropouts\n",
+            strerror(errno));
+        printf("Raise RLIMIT_MEMLOCK (ulimit -l) to allow it\n");
+        return;
+    }
+
+    printf("Locked memory\n");
+}
+
+/* Through the volatile array itself, a store to every page, so that none
+ * of them can be optimized away; reading one back tells the compiler the
+ * array is used. */
+static void prefault_stack(void) {
+    volatile char stack[PREFAULT_STACK];
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned i;
+
+    if (page <= 0) {
+        page = 4096;
+    }
+
+    for (i = 0; i < PREFAULT_STACK; i += page) {
+        stack[i] = 0;
+    }
+    stack[PREFAULT_STACK - 1] = 0;
+
+    (void)stack[0];
+}
+
+/* Called by each rendering thread on itself. The audio thread passes the
+ * CPU it was asked to run on; workers are already pinned. */
+void make_realtime(struct dioxide *d, const char *name, int cpu) {
+    struct sched_param param = { 0 };
+    cpu_set_t set;
+    int retval;
+
+    if (!d->rt_priority) {
+        return;
+    }
+
+    prefault_stack();
+
+    param.sched_priority = d->rt_priority;
+
+    retval = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (retval) {
+        printf("Couldn't run %s thread at SCHED_FIFO priority %d: %s\n",
+            name, d->rt_priority, strerror(retval));
+    }
+
+    if (cpu < 0) {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    retval = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+    if (retval) {
+        printf("Couldn't pin %s thread to CPU %d: %s\n", name, cpu,
+            strerror(retval));
+    }
+}
@@ -0,0 +1,416 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "dioxide.h"
+
+/* Set up to play rate samples a second on channels channels, a period at
+ * a time. The block is d->block_size, or 64 samples if that's unset. */
+void setup_engine(struct dioxide *d, unsigned rate, unsigned channels,
+                  unsigned period) {
+    if (d->simd == SIMD_AUTO) {
+        d->simd = detect_simd();
+    }
+
+    d->rate = rate;
+    d->channels = channels;
+    d->period = period;
+    d->samples = d->block_size ? d->block_size : 64;
+
+    d->inverse_sample_rate = 1.0 / rate;
+
+    d->knobs.volume = 1.0;
+
+    d->attack_time = 0.001;
+    d->decay_time = 0.001;
+    d->release_time = 0.001;
+
+    d->knobs.lpf_cutoff = rate * 0.5;
+    d->knobs.lpf_resonance = 4.0;
+    d->effects_knobs = d->knobs;
+
+    setup_queue(&d->events);
+
+    if (d->threads > MAX_THREADS) {
+        d->threads = MAX_THREADS;
+    }
+
+    d->front_buffer = malloc(d->samples * sizeof(float));
+    d->dry_buffer = malloc(d->samples * sizeof(float));
+    d->fade_buffer = malloc(d->samples * sizeof(float));
+    d->carry = malloc(d->samples * sizeof(signed short));
+    d->carried = 0;
+
+    setup_voices(d);
+    setup_titanium(d);
+    setup_uranium(d);
+    setup_workers(d);
+    setup_pipeline(d);
+
+    printf("Using %s voice kernels\n", simd_name(d->simd));
+
+    d->metal = &titanium;
+}
+
+void close_engine(struct dioxide *d) {
+    cleanup_pipeline(d);
+    cleanup_workers(d);
+    cleanup_titanium(d);
+    cleanup_uranium(d);
+    cleanup_voices(d);
+
+    free(d->front_buffer);
+    free(d->dry_buffer);
+    free(d->fade_buffer);
+    free(d->carry);
+}
+
+void update_pitch(struct dioxide *d) {
+    struct voices *v = &d->voices;
+    double bend = 0;
+    unsigned i;
+
+    switch (d->pitch_wheel_config) {
+        case WHEEL_TRADITIONAL:
+            bend = d->pitch_bend * (2.0 / 8192.0);
+            break;
+        case WHEEL_RUDESS:
+            /* Split the pitch wheel into an upper and lower range. */
+            if (d->pitch_bend >= 0) {
+                bend = d->pitch_bend * (2.0 / 8192.0);
+            } else {
+                bend = d->pitch_bend * (12.0 / 8192.0);
+            }
+            break;
+        case WHEEL_DIVEBOMB:
+            if (d->pitch_bend >= 0) {
+                bend = d->pitch_bend * (24.0 / 8192.0);
+            } else {
+                bend = d->pitch_bend * (36.0 / 8192.0);
+            }
+            break;
+    }
+
+    d->bend = bend;
+
+    for (i = 0; i < v->count; i++) {
+        v->pitch[i] = 440 * pow(2, (v->note[i] + bend - 69.0) / 12.0);
+    }
+}
+
+void convert_samples(struct dioxide *d, float *samples, signed short *buf,
+                     unsigned len) {
+    double accumulator;
+    unsigned i;
+
+    for (i = 0; i < len; i++) {
+        accumulator = samples[i];
+
+        accumulator *= d->effects_knobs.volume * -32767;
+
+        if (accumulator > 32767) {
+            accumulator = 32767;
+        } else if (accumulator < -32768) {
+            accumulator = -32768;
+        }
+
+        *buf = (signed short)accumulator;
+        buf++;
+    }
+}
+
+struct element *elements[] = { &titanium, &uranium, NULL };
+
+static int element_voices(struct voices *v, struct element *element) {
+    unsigned i;
+
+    for (i = 0; i < v->count; i++) {
+        if (v->element[i] == element) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Add voices first up to last, on every element, into buffer. */
+void generate_voices(struct dioxide *d, unsigned first, unsigned last,
+                     float *buffer, unsigned len, unsigned thread) {
+    unsigned long long then, now;
+    unsigned i;
+
+    for (i = 0; elements[i]; i++) {
+        then = event_clock();
+
+        elements[i]->generate(d, &d->voices, first, last, buffer, len,
+            thread);
+
+        now = event_clock();
+        atomic_fetch_add_explicit(&elements[i]->render_ns, now - then,
+            memory_order_relaxed);
+        trace_span(d, thread, "generate", elements[i]->name, last - first,
+            then);
+    }
+}
+
+/* Add every voice into samples. */
+static void render_dry(struct dioxide *d, float *samples, unsigned len,
+                       unsigned polyphony) {
+    struct element *element;
+    unsigned long long then, span;
+    unsigned i;
+
+    record_polyphony(d, polyphony);
+
+    /* Update pitch and envelope rates only once per (sub-)block. */
+    update_pitch(d);
+    update_envelopes(d);
+
+    /* Voices stay on the element they were started with, so after a
+     * program change both may be sounding. */
+    for (i = 0; elements[i]; i++) {
+        element = elements[i];
+
+        if (element->prepare && element_voices(&d->voices, element)) {
+            then = event_clock();
+            element->prepare(d, len);
+            atomic_fetch_add_explicit(&element->render_ns,
+                event_clock() - then, memory_order_relaxed);
+            trace_span(d, 0, "prepare", element->name, len, then);
+        }
+    }
+
+    span = trace_clock(d);
+    render_voices(d, samples, len);
+    trace_span(d, 0, "render", "voices", polyphony, span);
+
+#if 0
+    printf("initialsamples = [\n");
+    for (i = 0; i < len; i++) {
+        printf("%f,\n", samples[i]);
+    }
+    printf("]\n");
+#endif
+}
+
+/* Run the effects over len samples of dry voices in d->front_buffer, and
+ * convert the result into buf. thread is the caller's trace ring. With no
+ * voices, the effects still run for as long as their tails ring; after
+ * that, buf is filled with silence and they are not run at all. */
+void finish_block(struct dioxide *d, signed short *buf, unsigned len,
+                  unsigned polyphony, unsigned thread) {
+    unsigned long long then, span;
+    float *samples;
+
+    if (!polyphony && !effects_ringing(d)) {
+        settle_effects(d);
+        memset(buf, 0, len * sizeof(signed short));
+        return;
+    }
+
+    then = event_clock();
+
+    /* Ports were connected when the graph was compiled. */
+    samples = run_effects(d, len, thread);
+
+    atomic_fetch_add_explicit(&d->metrics.effects_ns, event_clock() - then,
+        memory_order_relaxed);
+
+    span = trace_clock(d);
+    convert_samples(d, samples, buf, len);
+    trace_span(d, thread, "render", "convert", len, span);
+}
+
+/* Render len samples of voices into samples with no events in between, or
+ * leave it untouched and return zero if there are none and nothing else
+ * will read it. Returns the number of voices that were rendered. */
+static unsigned render_block(struct dioxide *d, float *samples, unsigned len,
+                             int ringing) {
+    unsigned polyphony;
+
+    reap_voices(d);
+
+    polyphony = d->voices.count;
+
+    if (polyphony || ringing) {
+        memset(samples, 0, len * sizeof(float));
+    }
+
+    if (polyphony) {
+        render_dry(d, samples, len, polyphony);
+    }
+
+    return polyphony;
+}
+
+/* Sample offset of an event into a block starting at time, to the nearest
+ * sample, and clamped to the start of the block for events that are already
+ * late. */
+static unsigned long long event_offset(struct dioxide *d, struct event *event,
+                                       unsigned long long time) {
+    if (event->time <= time) {
+        return 0;
+    }
+
+    return ((event->time - time) * d->rate + 500000000ULL) /
+        1000000000ULL;
+}
+
+/* Apply every queued event due by sample start of a buffer of len samples
+ * starting at time, and return where the sub-block from start ends: at the
+ * next event still queued, or at len. */
+static unsigned apply_events(struct dioxide *d, unsigned start, unsigned len,
+                             unsigned long long time) {
+    unsigned long long offset, span;
+    struct event event;
+
+    while (!queue_peek(&d->events, &event)) {
+        offset = event_offset(d, &event, time);
+
+        if (offset > start) {
+            return offset < len ? offset : len;
+        }
+
+        span = trace_clock(d);
+        queue_pop(&d->events, &event);
+        apply_event(d, &event);
+        trace_span(d, 0, "apply", "event", event.type, span);
+    }
+
+    return len;
+}
+
+/* For the offline renderer and the stress harness, which are the sequencer
+ * and the audio thread at once: apply the oldest queued event right away,
+ * to make room in a full queue rather than drop anything. It takes effect
+ * from the next block on, not at its own sample. */
+void apply_oldest_event(struct dioxide *d) {
+    struct event event;
+
+    if (!queue_pop(&d->events, &event)) {
+        apply_event(d, &event);
+    }
+}
+
+/* Render len samples of voices alone into dry, starting at time on the
+ * event clock, for the pipeline; every sample of dry is written. Returns
+ * the most voices rendered in any sub-block. */
+unsigned render_voices_only(struct dioxide *d, float *dry, unsigned len,
+                            unsigned long long time) {
+    unsigned start = 0, end, polyphony = 0, rendered;
+
+    while (start < len) {
+        end = apply_events(d, start, len, time);
+
+        rendered = render_block(d, dry + start, end - start, 1);
+        if (rendered > polyphony) {
+            polyphony = rendered;
+        }
+
+        start = end;
+    }
+
+    return polyphony;
+}
+
+/* Render one block of d->samples into buf, starting at time on the event
+ * clock. Queued events take effect at their own sample offsets, by
+ * splitting the block into sub-blocks between them; events past the end
+ * of the block stay queued for the next one. Returns the most voices
+ * rendered in any sub-block.
+ *
+ * When pipelined, what comes out is the block before this one, with its
+ * effects run on another thread while this one's voices were rendered. */
+static unsigned render_one(struct dioxide *d, signed short *buf,
+                           unsigned long long time) {
+    unsigned start = 0, end, polyphony = 0, rendered, len = d->samples;
+    float *samples = d->front_buffer;
+
+    if (d->pipeline) {
+        return render_pipelined(d, buf, len, time);
+    }
+
+    while (start < len) {
+        end = apply_events(d, start, len, time);
+
+        rendered = render_block(d, samples, end - start, effects_ringing(d));
+        d->effects_knobs = d->knobs;
+        finish_block(d, buf + start, end - start, rendered, 0);
+
+        if (rendered > polyphony) {
+            polyphony = rendered;
+        }
+
+        start = end;
+    }
+
+    return polyphony;
+}
+
+/* Play up to len frames of what's left of the carried block into buf, on
+ * every channel, and return how many. */
+static unsigned drain_carry(struct dioxide *d, signed short *buf,
+                            unsigned len) {
+    signed short *from = d->carry + d->samples - d->carried;
+    unsigned count = len < d->carried ? len : d->carried, i, c;
+
+    if (d->channels == 1) {
+        memcpy(buf, from, count * sizeof(signed short));
+    } else {
+        for (i = 0; i < count; i++) {
+            for (c = 0; c < d->channels; c++) {
+                *buf++ = from[i];
+            }
+        }
+    }
+
+    d->carried -= count;
+
+    return count;
+}
+
+/* Render a device period of len frames into buf, interleaved over
+ * d->channels, starting at time on the event clock. The engine only ever
+ * renders whole blocks: blocks that fit go straight into buf, and the
+ * rest of one that doesn't is carried over into the next period. Returns
+ * the most voices in any block played from; if that is zero, the period
+ * was silent unless render_ringing() says a tail is still dying away. */
+unsigned render(struct dioxide *d, signed short *buf, unsigned len,
+                unsigned long long time) {
+    unsigned done, polyphony = 0, rendered;
+    unsigned long long start;
+
+    done = drain_carry(d, buf, len);
+    if (done) {
+        polyphony = d->carry_polyphony;
+    }
+
+    while (done < len) {
+        start = time + 1000000000ULL * done / d->rate;
+
+        if (d->channels == 1 && len - done >= d->samples) {
+            rendered = render_one(d, buf + done, start);
+            done += d->samples;
+        } else {
+            rendered = render_one(d, d->carry, start);
+            d->carried = d->samples;
+            d->carry_polyphony = rendered;
+            done += drain_carry(d, buf + done * d->channels, len - done);
+        }
+
+        if (rendered > polyphony) {
+            polyphony = rendered;
+        }
+    }
+
+    return polyphony;
+}
+
+/* Whether effect tails were still ringing at the end of the last block,
+ * so that output mustn't be paused yet. */
+int render_ringing(struct dioxide *d) {
+    if (d->pipeline) {
+        return pipeline_ringing(d);
+    }
+
+    return effects_ringing(d);
+}
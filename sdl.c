@@ -0,0 +1,88 @@
+#include <stdlib.h>
+
+#include "SDL.h"
+#include "SDL_audio.h"
+
+#include "dioxide.h"
+
+/* The original backend: SDL's callback thread, with SDL converting and
+ * copying each buffer on its way to the device. Output is paused while
+ * nothing is playing and no effect tail is left ringing. */
+
+/* SDL starts the callback thread; it's made realtime from the inside. */
+static int realtime;
+
+static void write_sound(void *private, Uint8 *stream, int len) {
+    struct dioxide *d = private;
+    unsigned long long then, start;
+
+    then = event_clock();
+
+    if (!realtime) {
+        make_realtime(d, "audio", d->rt_cpu);
+        realtime = 1;
+    }
+
+    /* Treat len as counting frames, not bytes.
+     * Avoids cognitive dissonance in later code. */
+    len /= 2 * d->channels;
+
+    /* Play events one buffer late, at the offsets they arrived at during
+     * the previous buffer, rather than bunched up at its start. */
+    start = then - 1000000000ULL * len / d->rate;
+
+    /* Don't pause if a note arrived after render() drained the queue;
+     * the sequencer thread only unpauses after queueing. */
+    if (!render(d, (signed short*)stream, len, start) &&
+        !render_ringing(d) && !queue_pending(&d->events)) {
+        SDL_PauseAudio(1);
+        return;
+    }
+
+    record_callback(d, then, len);
+    trace_span(d, 0, "audio", "callback", len, then);
+}
+
+static void setup_sdl(struct dioxide *d) {
+    struct SDL_AudioSpec wanted, actual;
+
+    wanted.freq = d->sample_rate;
+    wanted.format = AUDIO_S16;
+    wanted.channels = d->channels;
+    wanted.samples = d->period_size;
+    wanted.callback = write_sound;
+    wanted.userdata = d;
+
+    if (SDL_OpenAudio(&wanted, &actual)) {
+        printf("Couldn't setup sound: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Opened sound for playback: Rate %d, format %d, channels %d, "
+        "samples %d\n", actual.freq, actual.format, actual.channels,
+        actual.samples);
+
+    setup_engine(d, actual.freq, actual.channels, actual.samples);
+
+    printf("Initialized basic synth parameters, frame length is %d usec, "
+        "block %u samples\n", 1000 * 1000 * actual.samples / actual.freq,
+        d->samples);
+}
+
+static void resume_sdl(struct dioxide *d) {
+    SDL_PauseAudio(0);
+}
+
+static void close_sdl(struct dioxide *d) {
+    SDL_PauseAudio(1);
+    SDL_CloseAudio();
+
+    close_engine(d);
+}
+
+struct backend sdl_backend = {
+    "sdl",
+    setup_sdl,
+    resume_sdl,
+    close_sdl,
+};
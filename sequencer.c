@@ -81,29 +81,28 @@ void handle_controller(struct dioxide *d, snd_seq_ev_ctrl_t control) {
             break;
         /* C14 */
         case 10:
-            d->chorus_delay = scale_pot_log_float(control.value, 2.5, 40);
-            d->lpf_resonance = scale_pot_float(control.value, 0.0, 4.0);
+            d->knobs.chorus_delay = scale_pot_log_float(control.value, 2.5, 40);
+            d->knobs.lpf_resonance = scale_pot_float(control.value, 0.0, 4.0);
             break;
         /* C15 */
         case 77:
-            d->phaser_rate = scale_pot_float(control.value, 0, 1);
-            d->phaser_depth = scale_pot_float(control.value, 0, 1);
+            d->knobs.phaser_rate = scale_pot_float(control.value, 0, 1);
+            d->knobs.phaser_depth = scale_pot_float(control.value, 0, 1);
             break;
         /* C16 */
         case 78:
-            d->phaser_spread = scale_pot_float(control.value, 0, 1.5708);
+            d->knobs.phaser_spread = scale_pot_float(control.value, 0, 1.5708);
             break;
         /* C17 */
         case 79:
-            d->phaser_feedback = scale_pot_float(control.value, 0, 0.999);
+            d->knobs.phaser_feedback = scale_pot_float(control.value, 0, 0.999);
             break;
         /* C34 */
         case 1:
-            d->volume = scale_pot_float(control.value, 0.0, 1.0);
+            d->knobs.volume = scale_pot_float(control.value, 0.0, 1.0);
             break;
         default:
-            printf("Controller %d\n", control.param);
-            printf("Value %d\n", control.value);
+            /* Unmapped. This runs on the audio thread, so no printing. */
             break;
     }
 }
@@ -129,116 +128,201 @@ void handle_program_change(struct dioxide *d, snd_seq_ev_ctrl_t control) {
         case 3:
             break;
         default:
-            printf("Program change %d\n", control.value);
             break;
     }
 }
 
-void poll_sequencer(struct dioxide *d) {
-    snd_seq_event_t *event;
-    enum snd_seq_event_type type;
-    struct note *note;
-    unsigned i, repeated = 0;
+/* Audio thread: act on an event popped from the queue. */
+void apply_event(struct dioxide *d, struct event *event) {
+    snd_seq_ev_ctrl_t control;
 
-    if (snd_seq_event_input(d->seq, &event) == -EAGAIN) {
-        return;
+    switch (event->type) {
+        case SND_SEQ_EVENT_NOTEON:
+            voice_on(d, event->param);
+            break;
+        case SND_SEQ_EVENT_NOTEOFF:
+            voice_off(d, event->param);
+            break;
+        case SND_SEQ_EVENT_CONTROLLER:
+            control.param = event->param;
+            control.value = event->value;
+            handle_controller(d, control);
+            break;
+        case SND_SEQ_EVENT_PGMCHANGE:
+            control.value = event->value;
+            handle_program_change(d, control);
+            break;
+        case SND_SEQ_EVENT_PITCHBEND:
+            d->pitch_bend = event->value;
+            break;
+        default:
+            break;
     }
+}
+
+/* Sequencer thread: anything that touches synth state is queued for the
+ * audio thread, stamped with time, rather than applied here. */
+void handle_event(struct dioxide *d, snd_seq_event_t *event,
+                  unsigned long long time) {
+    enum snd_seq_event_type type;
+    struct event queued = { 0 };
+
+    queued.time = time;
 
     type = event->type;
 
     switch (type) {
         case SND_SEQ_EVENT_NOTEON:
-            for (note = d->notes->next; note; note = note->next) {
-                if (note->note == event->data.note.note) {
-                    repeated = 1;
-                    break;
-                }
-            }
-
-            if (!note) {
-                note = calloc(1, sizeof(struct note));
-                note->next = d->notes->next;
-                d->notes->next = note;
-            }
-
-            note->note = event->data.note.note;
-            note->adsr_phase = ADSR_ATTACK;
-            note->adsr_volume = 0.0;
-
-            SDL_PauseAudio(0);
-
-            break;
         case SND_SEQ_EVENT_NOTEOFF:
-            for (note = d->notes->next; note; note = note->next) {
-                if (note->note == event->data.note.note) {
-                    note->adsr_phase = ADSR_RELEASE;
-                }
-            }
-
+            queued.type = type;
+            queued.param = event->data.note.note;
             break;
         case SND_SEQ_EVENT_CONTROLLER:
-            handle_controller(d, event->data.control);
+            queued.type = type;
+            queued.param = event->data.control.param;
+            queued.value = event->data.control.value;
             break;
         case SND_SEQ_EVENT_PGMCHANGE:
-            handle_program_change(d, event->data.control);
-            break;
         case SND_SEQ_EVENT_PITCHBEND:
-            d->pitch_bend = event->data.control.value;
-            break;
+            queued.type = type;
+            queued.value = event->data.control.value;
+            break;
+        case SND_SEQ_EVENT_PORT_START:
+            /* Announced; maybe a controller was just plugged in. */
+            connect_port(d, event->data.addr.client, event->data.addr.port);
+            break;
+        case SND_SEQ_EVENT_CLIENT_START:
+        case SND_SEQ_EVENT_CLIENT_EXIT:
+        case SND_SEQ_EVENT_CLIENT_CHANGE:
+        case SND_SEQ_EVENT_PORT_EXIT:
+        case SND_SEQ_EVENT_PORT_CHANGE:
         case SND_SEQ_EVENT_PORT_SUBSCRIBED:
             break;
         case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
-            d->connected = 0;
+            if (event->data.connect.sender.client != SND_SEQ_CLIENT_SYSTEM &&
+                d->connected) {
+                d->connected--;
+            }
             break;
         default:
             printf("Got event type %u\n", type);
             break;
     }
+
+    /* SND_SEQ_EVENT_SYSTEM is zero, and never queued. */
+    if (queued.type && queue_push(&d->events, &queued)) {
+        printf("Event queue full, dropped event type %u (%u so far)\n",
+            type, d->events.dropped);
+    }
 }
 
-void solicit_connections(struct dioxide *d) {
+/* Handle every event that's waiting, not just the first; the sequencer is
+ * nonblocking, and this is called whenever poll() says it's readable. */
+void poll_sequencer(struct dioxide *d) {
+    snd_seq_event_t *event;
+    unsigned long long then;
+    int retval, notes = 0;
+
+    for (;;) {
+        retval = snd_seq_event_input(d->seq, &event);
+
+        if (retval == -ENOSPC) {
+            printf("Sequencer input overran; events were lost\n");
+            continue;
+        } else if (retval < 0) {
+            break;
+        }
+
+        then = event_clock();
+        handle_event(d, event, then);
+        trace_span(d, TRACE_SEQUENCER, "sequencer", "event", event->type,
+            then);
+
+        if (event->type == SND_SEQ_EVENT_NOTEON) {
+            notes = 1;
+        }
+    }
+
+    if (notes) {
+        d->backend->resume(d);
+    }
+}
+
+static int match_controller(struct dioxide *d, const char *name) {
+    unsigned i;
+
+    for (i = 0; i < d->controller_count; i++) {
+        if (strstr(name, d->controllers[i])) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Subscribe to a port if its client's name matches one of the controller
+ * patterns, and it can be read from. */
+void connect_port(struct dioxide *d, int client, int port) {
     snd_seq_client_info_t *client_info;
     snd_seq_port_info_t *port_info;
     int caps, retval;
 
+    if (client == SND_SEQ_CLIENT_SYSTEM ||
+        client == snd_seq_client_id(d->seq)) {
+        return;
+    }
+
+    snd_seq_client_info_alloca(&client_info);
+    snd_seq_port_info_alloca(&port_info);
+
+    if (snd_seq_get_any_client_info(d->seq, client, client_info) ||
+        snd_seq_get_any_port_info(d->seq, client, port, port_info)) {
+        return;
+    }
+
+    if (!match_controller(d, snd_seq_client_info_get_name(client_info))) {
+        return;
+    }
+
+    caps = snd_seq_port_info_get_capability(port_info);
+
+    if (!(caps & SND_SEQ_PORT_CAP_SUBS_READ)) {
+        return;
+    }
+
+    retval = snd_seq_connect_from(d->seq, d->seq_port, client, port);
+
+    if (retval) {
+        printf("Failed to solicit connection: %s\n", snd_strerror(retval));
+    } else {
+        printf("Successfully connected a device: %s::%s\n",
+            snd_seq_client_info_get_name(client_info),
+            snd_seq_port_info_get_name(port_info));
+        d->connected++;
+    }
+}
+
+/* Connect every matching port that's already there. Ones that show up
+ * later are announced, and connected from handle_event(). */
+void solicit_connections(struct dioxide *d) {
+    snd_seq_client_info_t *client_info;
+    snd_seq_port_info_t *port_info;
+
     snd_seq_client_info_alloca(&client_info);
     snd_seq_port_info_alloca(&port_info);
 
     snd_seq_client_info_set_client(client_info, -1);
 
     while (!snd_seq_query_next_client(d->seq, client_info)) {
-        if (!strstr(
-            snd_seq_client_info_get_name(client_info), "Oxygen 61")) {
-            continue;
-        }
-
         snd_seq_port_info_set_client(port_info,
             snd_seq_client_info_get_client(client_info));
         snd_seq_port_info_set_port(port_info, -1);
 
         while (!snd_seq_query_next_port(d->seq, port_info)) {
-            caps = snd_seq_port_info_get_capability(port_info);
-
-            if (!(caps & SND_SEQ_PORT_CAP_SUBS_READ)) {
-                continue;
-            }
-
-            retval = snd_seq_connect_from(d->seq, d->seq_port,
-                snd_seq_client_info_get_client(client_info),
+            connect_port(d, snd_seq_port_info_get_client(port_info),
                 snd_seq_port_info_get_port(port_info));
-
-            if (retval) {
-                printf("Failed to solicit connection: %s\n",
-                    snd_strerror(retval));
-            } else {
-                printf("Successfully connected a device: %s::%s\n",
-                    snd_seq_client_info_get_name(client_info),
-                    snd_seq_port_info_get_name(port_info));
-                d->connected++;
-                return;
-            }
         }
-   }
+    }
 }
 
 void setup_sequencer(struct dioxide *d) {
@@ -264,4 +348,20 @@ void setup_sequencer(struct dioxide *d) {
     } else {
         d->seq_port = retval;
     }
+
+    /* Client and port comings and goings arrive as events. */
+    retval = snd_seq_connect_from(d->seq, d->seq_port,
+        SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE);
+
+    if (retval) {
+        printf("Couldn't subscribe to announcements: %s\n",
+            snd_strerror(retval));
+        printf("Controllers plugged in from now on won't be connected\n");
+    }
+
+    if (!d->controller_count) {
+        d->controllers[d->controller_count++] = "Oxygen 61";
+    }
+
+    solicit_connections(d);
 }
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dioxide.h"
+
+/* Worst-case latency harness. Replays synthetic MIDI event storms through
+ * handle_event() and render(), with no sound card or sequencer, and reports
+ * callback duration percentiles against the buffer's realtime budget. The
+ * event clock is virtual: callback N starts at N buffers' worth of
+ * nanoseconds. */
+
+#define RATE 48000
+#define SAMPLES 512
+
+struct scenario {
+    const char *name;
+    const char *description;
+
+    /* Events delivered before the callback. */
+    void (*before)(struct dioxide *d, unsigned callback);
+    /* Events delivered halfway through the callback, if any. */
+    void (*during)(struct dioxide *d, unsigned callback);
+};
+
+static unsigned long rng_state = 1;
+
+/* Event clock time that send() stamps events with. */
+static unsigned long long stamp;
+
+static unsigned long rng(void) {
+    /* xorshift32; reproducible across runs and machines. */
+    rng_state ^= (rng_state << 13) & 0xffffffff;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= (rng_state << 5) & 0xffffffff;
+
+    return rng_state;
+}
+
+static void send(struct dioxide *d, enum snd_seq_event_type type,
+                 unsigned param, int value) {
+    snd_seq_event_t event;
+
+    memset(&event, 0, sizeof(snd_seq_event_t));
+    event.type = type;
+
+    switch (type) {
+        case SND_SEQ_EVENT_NOTEON:
+        case SND_SEQ_EVENT_NOTEOFF:
+            event.data.note.note = param;
+            event.data.note.velocity = value;
+            break;
+        default:
+            event.data.control.param = param;
+            event.data.control.value = value;
+            break;
+    }
+
+    /* Never drop events; that would flatter the numbers. */
+    while (queue_full(&d->events)) {
+        apply_oldest_event(d);
+    }
+
+    handle_event(d, &event, stamp);
+}
+
+/* Controllers that handle_controller() knows about. */
+static unsigned controllers[] = {
+    74, 71, 91, 93, 73, 72, 5, 84, 7, 76, 92, 95, 10, 77, 78, 79, 1,
+};
+
+static void storm_random(struct dioxide *d, unsigned callback) {
+    unsigned events = rng() % 33, roll;
+
+    while (events--) {
+        roll = rng() % 100;
+
+        if (roll < 40) {
+            send(d, SND_SEQ_EVENT_NOTEON, 24 + rng() % 85, 100);
+        } else if (roll < 80) {
+            send(d, SND_SEQ_EVENT_NOTEOFF, 24 + rng() % 85, 0);
+        } else if (roll < 90) {
+            send(d, SND_SEQ_EVENT_CONTROLLER,
+                controllers[rng() % (sizeof(controllers) / sizeof(unsigned))],
+                rng() % 128);
+        } else if (roll < 95) {
+            send(d, SND_SEQ_EVENT_PITCHBEND, 0, (int)(rng() % 16384) - 8192);
+        } else {
+            send(d, SND_SEQ_EVENT_PGMCHANGE, 0, 0);
+        }
+    }
+}
+
+static void storm_chord(struct dioxide *d, unsigned callback) {
+    unsigned i;
+
+    /* Strike every key, hold, release everything, strike again. */
+    switch (callback % 64) {
+        case 0:
+            for (i = 0; i < 128; i++) {
+                send(d, SND_SEQ_EVENT_NOTEON, i, 100);
+            }
+            break;
+        case 48:
+            for (i = 0; i < 128; i++) {
+                send(d, SND_SEQ_EVENT_NOTEOFF, i, 0);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void hold_chord(struct dioxide *d, unsigned callback) {
+    static unsigned chord[] = { 36, 43, 48, 52, 55, 60, 64, 67 };
+    unsigned i;
+
+    if (!callback) {
+        for (i = 0; i < sizeof(chord) / sizeof(unsigned); i++) {
+            send(d, SND_SEQ_EVENT_NOTEON, chord[i], 100);
+        }
+    }
+}
+
+static void storm_cc(struct dioxide *d, unsigned callback) {
+    unsigned i;
+
+    hold_chord(d, callback);
+
+    /* Sweep C14 and C15 as fast as a controller can send them. */
+    for (i = 0; i < 128; i++) {
+        send(d, SND_SEQ_EVENT_CONTROLLER, i % 2 ? 77 : 10,
+            (callback + i) % 128);
+    }
+}
+
+static void storm_bend(struct dioxide *d, unsigned callback) {
+    unsigned i;
+
+    if (!callback) {
+        /* Traditional, Rudess, then divebomb, the widest range. */
+        send(d, SND_SEQ_EVENT_PGMCHANGE, 0, 2);
+        send(d, SND_SEQ_EVENT_PGMCHANGE, 0, 2);
+    }
+
+    hold_chord(d, callback);
+
+    for (i = 0; i < 64; i++) {
+        send(d, SND_SEQ_EVENT_PITCHBEND, 0, (int)(rng() % 16384) - 8192);
+    }
+}
+
+static void storm_churn(struct dioxide *d, unsigned callback) {
+    unsigned i, base = 24 + (callback * 7) % 72;
+
+    /* Restrike a fresh handful of notes every callback, so the voice list
+     * is constantly growing and being reaped. */
+    for (i = 0; i < 12; i++) {
+        send(d, SND_SEQ_EVENT_NOTEOFF, (base + 128 - 12 + i) % 128, 0);
+        send(d, SND_SEQ_EVENT_NOTEON, base + i, 100);
+    }
+}
+
+static void toggle_metal(struct dioxide *d, unsigned callback) {
+    send(d, SND_SEQ_EVENT_PGMCHANGE, 0, 0);
+}
+
+static struct scenario scenarios[] = {
+    { "random", "randomized notes, controllers, bends and program changes",
+        storm_random, NULL },
+    { "chord128", "all 128 notes struck and released together",
+        storm_chord, NULL },
+    { "cc-flood", "C14/C15 floods over a held chord",
+        storm_cc, NULL },
+    { "bend-flood", "divebomb pitch bend floods over a held chord",
+        storm_bend, NULL },
+    { "churn", "a dozen notes restruck every callback",
+        storm_churn, NULL },
+    { "metal-toggle", "program change 0 in the middle of every callback",
+        hold_chord, toggle_metal },
+};
+
+#define SCENARIOS (sizeof(scenarios) / sizeof(struct scenario))
+
+static unsigned long long now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+    const unsigned long long *first = a, *second = b;
+
+    return *first < *second ? -1 : *first > *second;
+}
+
+static unsigned long long percentile(unsigned long long *latencies,
+                                     unsigned count, double p) {
+    unsigned i = p / 100.0 * count;
+
+    return latencies[i < count ? i : count - 1];
+}
+
+static void reset(struct dioxide *d) {
+    unsigned i;
+
+    clear_voices(d);
+
+    d->metal = &titanium;
+    d->pitch_bend = 0;
+    d->pitch_wheel_config = WHEEL_TRADITIONAL;
+
+    d->attack_time = 0.001;
+    d->decay_time = 0.001;
+    d->release_time = 0.001;
+
+    for (i = 0; i < 9; i++) {
+        d->drawbars[i] = i < 3 ? 8 : 0;
+    }
+}
+
+/* Returns nonzero if the scenario blew the budget at p99.9. */
+static int run_scenario(struct dioxide *d, struct scenario *s,
+                        unsigned callbacks, unsigned long seed) {
+    signed short buf[SAMPLES];
+    unsigned long long *latencies, then, elapsed, budget, period;
+    unsigned i, count = 0, idle = 0, misses = 0, polyphony;
+    unsigned long long p999;
+
+    budget = 1000000000ULL * SAMPLES / RATE;
+    period = budget;
+    latencies = malloc(callbacks * sizeof(unsigned long long));
+
+    reset(d);
+    rng_state = seed;
+
+    for (i = 0; i < callbacks; i++) {
+        stamp = i * period;
+        s->before(d, i);
+
+        if (s->during) {
+            /* render() splits the buffer around these itself. */
+            stamp += period / 2;
+            s->during(d, i);
+        }
+
+        then = now();
+        polyphony = render(d, buf, SAMPLES, i * period);
+        elapsed = now() - then;
+
+        /* The live callback pauses the device when nothing is playing. */
+        if (!polyphony && !render_ringing(d)) {
+            idle++;
+            continue;
+        }
+
+        if (elapsed > budget) {
+            misses++;
+        }
+
+        latencies[count++] = elapsed;
+    }
+
+    if (!count) {
+        printf("%-13s no audible callbacks\n", s->name);
+        free(latencies);
+        return 0;
+    }
+
+    qsort(latencies, count, sizeof(unsigned long long), compare_latencies);
+
+    p999 = percentile(latencies, count, 99.9);
+
+    printf("%-13s %8u %6u %9.1f %9.1f %9.1f %9.1f %7u %6.1f%%\n", s->name,
+        count, idle,
+        percentile(latencies, count, 50) / 1000.0,
+        percentile(latencies, count, 99) / 1000.0,
+        p999 / 1000.0,
+        latencies[count - 1] / 1000.0,
+        misses,
+        100.0 * latencies[count - 1] / budget);
+
+    free(latencies);
+
+    return p999 > budget;
+}
+
+void usage(const char *name) {
+    unsigned i;
+
+    printf("Usage: %s [-c callbacks] [-j threads] [-s seed] [-S scenario]\n",
+        name);
+    printf("       [-B samples]\n");
+    printf("  -B N     Samples per engine block (default 64)\n");
+    printf("  -c N     Callbacks per scenario (default 1000)\n");
+    printf("  -j N     Worker threads for voice rendering (default 0)\n");
+    printf("  -s N     Random seed (default 1)\n");
+    printf("  -S NAME  Run only this scenario:\n");
+    for (i = 0; i < SCENARIOS; i++) {
+        printf("           %-13s %s\n", scenarios[i].name,
+            scenarios[i].description);
+    }
+    printf("Exits nonzero if any scenario's p99.9 exceeds the budget.\n");
+}
+
+int main(int argc, char **argv) {
+    struct dioxide *d = calloc(1, sizeof(struct dioxide));
+    const char *only = NULL;
+    unsigned i, callbacks = 1000, ran = 0;
+    unsigned long seed = 1;
+    int opt, failed = 0;
+
+    if (!d) {
+        exit(EXIT_FAILURE);
+    }
+
+    while ((opt = getopt(argc, argv, "B:c:hj:s:S:")) != -1) {
+        switch (opt) {
+            case 'B':
+                if (set_setting(d, "block", optarg)) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                callbacks = strtoul(optarg, NULL, 0);
+                break;
+            case 'j':
+                d->threads = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                only = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    /* xorshift gets stuck on zero. */
+    if (!seed || !callbacks) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    setup_engine(d, RATE, 1, SAMPLES);
+    setup_plugins(d);
+
+    printf("\nRate %d, buffer %d samples in blocks of %u, budget %.1f usec "
+        "per callback\n\n", RATE, SAMPLES, d->samples, 1e6 * SAMPLES / RATE);
+    printf("%-13s %8s %6s %9s %9s %9s %9s %7s %7s\n", "scenario",
+        "callback", "idle", "p50 us", "p99 us", "p99.9 us", "max us",
+        "misses", "budget");
+
+    for (i = 0; i < SCENARIOS; i++) {
+        if (only && strcmp(only, scenarios[i].name)) {
+            continue;
+        }
+
+        failed |= run_scenario(d, &scenarios[i], callbacks, seed);
+        ran++;
+    }
+
+    if (!ran) {
+        printf("No such scenario: %s\n", only);
+        failed = 1;
+    }
+
+    reset(d);
+    close_engine(d);
+    cleanup_plugins(d);
+    free(d);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,85 +1,265 @@
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "dioxide.h"
 
-/* These are technically twice the correct frequency. It makes the maths a bit
- * easier conceptually. */
-static float drawbar_pitches[9] = {
-    0.5,
-    1.5,
-    1,
-    2,
-    3,
-    4,
-    5,
-    6,
-    8,
+/* Like a real organ, every key shares one bank of tonewheels, a semitone
+ * apart. Each drawbar taps the wheel this many semitones away from the key:
+ * 16', 5 1/3', 8', 4', 2 2/3', 2', 1 3/5', 1 1/3' and 1'. The fifths and
+ * thirds land on tempered wheels, as on the real thing. */
+static int drawbar_offsets[9] = {
+    -12,
+    7,
+    0,
+    12,
+    19,
+    24,
+    28,
+    31,
+    36,
 };
 
-void generate_titanium(struct dioxide *d, struct note *note, float *buffer, unsigned size)
-{
-    double step, accumulator;
-    unsigned i, j, attenuation;
+/* Wheel 0 sounds a 16' tap on MIDI note 0; the top wheel is a 1' tap on
+ * note 127. */
+#define WHEEL_BASE 12
+#define WHEELS (WHEEL_BASE + 128 + 36)
 
-    step = 2 * M_PI * note->pitch * d->inverse_sample_rate;
+struct tonewheel {
+    uint32_t phase;
+    double frequency;
 
-    for (i = 0; i < size; i++) {
-        accumulator = 0;
-        attenuation = 0;
+    /* Number of sounding taps on this wheel for the current buffer. */
+    unsigned taps;
+    float *samples;
+};
 
-        d->metal->adsr(d, note);
+static struct tonewheel wheels[WHEELS];
+static float *wheel_samples;
 
-        for (j = 0; j < 9; j++) {
-            if (d->drawbars[j]) {
-                attenuation++;
-                accumulator += (1.0/8.0) * d->drawbars[j] *
-                    sin(note->phase * drawbar_pitches[j]);
-            }
+/* Envelope for the key being mixed, one gain per sample; one buffer for
+ * each rendering thread. */
+static float **gains;
+static unsigned gains_count;
+
+typedef void (*mix_func)(float *buffer, const float *gains, float **taps,
+                         const float *weights, unsigned count,
+                         unsigned start, unsigned size);
+
+static void mix_taps_scalar(float *buffer, const float *gains, float **taps,
+                            const float *weights, unsigned count,
+                            unsigned start, unsigned size) {
+    float accumulator;
+    unsigned i, j;
+
+    for (i = start; i < size; i++) {
+        accumulator = 0;
+
+        for (j = 0; j < count; j++) {
+            accumulator += weights[j] * taps[j][i];
         }
 
-        if (attenuation) {
-            accumulator /= attenuation;
+        buffer[i] += accumulator * gains[i];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Each key's taps are whole buffers from the bank, so the mix vectorizes
+ * along the buffer. */
+
+__attribute__((target("sse2")))
+static void mix_taps_sse2(float *buffer, const float *gains, float **taps,
+                          const float *weights, unsigned count,
+                          unsigned start, unsigned size) {
+    __m128 accumulator;
+    unsigned i, j;
+
+    for (i = start; i + 4 <= size; i += 4) {
+        accumulator = _mm_setzero_ps();
+
+        for (j = 0; j < count; j++) {
+            accumulator = _mm_add_ps(accumulator, _mm_mul_ps(
+                _mm_set1_ps(weights[j]), _mm_loadu_ps(taps[j] + i)));
         }
 
-        note->phase += step;
+        _mm_storeu_ps(buffer + i, _mm_add_ps(_mm_loadu_ps(buffer + i),
+            _mm_mul_ps(accumulator, _mm_loadu_ps(gains + i))));
+    }
+
+    mix_taps_scalar(buffer, gains, taps, weights, count, i, size);
+}
+
+__attribute__((target("avx2")))
+static void mix_taps_avx2(float *buffer, const float *gains, float **taps,
+                          const float *weights, unsigned count,
+                          unsigned start, unsigned size) {
+    __m256 accumulator;
+    unsigned i, j;
 
-        while (note->phase > 2 * M_PI) {
-            note->phase -= 2 * M_PI;
+    for (i = start; i + 8 <= size; i += 8) {
+        accumulator = _mm256_setzero_ps();
+
+        for (j = 0; j < count; j++) {
+            accumulator = _mm256_add_ps(accumulator, _mm256_mul_ps(
+                _mm256_set1_ps(weights[j]), _mm256_loadu_ps(taps[j] + i)));
         }
 
-        *buffer += accumulator * note->adsr_volume;
-        buffer++;
+        _mm256_storeu_ps(buffer + i, _mm256_add_ps(_mm256_loadu_ps(buffer + i),
+            _mm256_mul_ps(accumulator, _mm256_loadu_ps(gains + i))));
     }
+
+    mix_taps_scalar(buffer, gains, taps, weights, count, i, size);
 }
+#endif
 
-void adsr_titanium(struct dioxide *d, struct note *note) {
-    static float peak = 1.0;
-    switch (note->adsr_phase) {
-        case ADSR_ATTACK:
-            if (note->adsr_volume < peak) {
-                note->adsr_volume += d->inverse_sample_rate / d->attack_time;
-            } else {
-                note->adsr_volume = peak;
-                note->adsr_phase = ADSR_SUSTAIN;
-            }
-            break;
-        case ADSR_SUSTAIN:
+static mix_func mix_taps = mix_taps_scalar;
+
+void setup_titanium(struct dioxide *d) {
+    unsigned i;
+
+    wheel_samples = calloc(WHEELS * d->samples, sizeof(float));
+
+    gains_count = d->threads + 1;
+    gains = calloc(gains_count, sizeof(float*));
+    for (i = 0; i < gains_count; i++) {
+        gains[i] = calloc(d->samples, sizeof(float));
+    }
+
+    for (i = 0; i < WHEELS; i++) {
+        wheels[i].frequency = 440 * pow(2, (i - WHEEL_BASE - 69.0) / 12.0);
+        wheels[i].samples = wheel_samples + i * d->samples;
+    }
+
+    switch (d->simd) {
+#if defined(__x86_64__) || defined(__i386__)
+        case SIMD_AVX2:
+            mix_taps = mix_taps_avx2;
             break;
-        case ADSR_RELEASE:
-            if (note->adsr_volume > 0.0) {
-                note->adsr_volume -= peak * d->inverse_sample_rate
-                    / d->release_time;
-            } else {
-                note->adsr_volume = 0.0;
-            }
+        case SIMD_SSE2:
+            mix_taps = mix_taps_sse2;
             break;
+#endif
         default:
+            mix_taps = mix_taps_scalar;
             break;
     }
 }
 
+void cleanup_titanium(struct dioxide *d) {
+    unsigned i;
+
+    for (i = 0; i < gains_count; i++) {
+        free(gains[i]);
+    }
+
+    free(wheel_samples);
+    free(gains);
+    wheel_samples = NULL;
+    gains = NULL;
+    gains_count = 0;
+}
+
+/* Spin the bank once per buffer, rendering only the wheels that some key
+ * is listening to. Pitch bend is global, so it's applied to the wheels
+ * rather than the keys. */
+void prepare_titanium(struct dioxide *d, unsigned size) {
+    struct voices *v = &d->voices;
+    struct tonewheel *wheel;
+    uint32_t step, phase;
+    double bend;
+    unsigned i, j;
+
+    for (i = 0; i < WHEELS; i++) {
+        wheels[i].taps = 0;
+    }
+
+    for (i = 0; i < v->count; i++) {
+        if (v->element[i] != &titanium) {
+            continue;
+        }
+
+        for (j = 0; j < 9; j++) {
+            if (d->drawbars[j]) {
+                wheels[v->note[i] + drawbar_offsets[j] + WHEEL_BASE].taps++;
+            }
+        }
+    }
+
+    bend = pow(2, d->bend / 12.0);
+
+    for (i = 0; i < WHEELS; i++) {
+        wheel = &wheels[i];
+        step = osc_step(wheel->frequency * bend, d->inverse_sample_rate);
+        phase = wheel->phase;
+
+        if (wheel->taps) {
+            for (j = 0; j < size; j++) {
+                wheel->samples[j] = osc_sin(phase + step * j);
+            }
+        }
+
+        /* Idle wheels keep turning, so that keys find them in phase. */
+        wheel->phase = phase + step * size;
+    }
+}
+
+void generate_titanium(struct dioxide *d, struct voices *v, unsigned first,
+                       unsigned last, float *buffer, unsigned size,
+                       unsigned thread) {
+    float *taps[9], weights[9], *gain = gains[thread];
+    int offsets[9];
+    unsigned j, k, attenuation = 0;
+
+    for (j = 0; j < 9; j++) {
+        if (d->drawbars[j]) {
+            offsets[attenuation] = drawbar_offsets[j] + WHEEL_BASE;
+            weights[attenuation] = (1.0/8.0) * d->drawbars[j];
+            attenuation++;
+        }
+    }
+
+    for (j = 0; j < attenuation; j++) {
+        weights[j] /= attenuation;
+    }
+
+    for (k = first; k < last; k++) {
+        if (v->element[k] != &titanium) {
+            continue;
+        }
+
+        step_envelope(d, v, k, gain, 1, size);
+
+        if (!attenuation) {
+            continue;
+        }
+
+        for (j = 0; j < attenuation; j++) {
+            taps[j] = wheels[v->note[k] + offsets[j]].samples;
+        }
+
+        mix_taps(buffer, gain, taps, weights, attenuation, 0, size);
+    }
+}
+
+/* Mixing is by far the bulk of the work, and it scales with the taps. */
+float cost_titanium(struct dioxide *d, struct voices *v, unsigned voice) {
+    unsigned j, taps = 0;
+
+    for (j = 0; j < 9; j++) {
+        if (d->drawbars[j]) {
+            taps++;
+        }
+    }
+
+    return 1.5 + 0.25 * taps;
+}
+
+/* Organ keys have no decay; they speak at full volume until let go. */
 struct element titanium = {
+    "titanium",
+    prepare_titanium,
     generate_titanium,
-    adsr_titanium,
+    cost_titanium,
+    1.0,
+    1.0,
 };
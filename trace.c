@@ -0,0 +1,243 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dioxide.h"
+
+/* Opt-in tracing of every stage of rendering, and of every sequencer
+ * event, for chasing one-off spikes. Each thread that records spans owns a
+ * preallocated single-producer ring; a low-priority thread drains the rings
+ * every so often and writes them out as Chrome trace event JSON, which
+ * chrome://tracing and Perfetto both open. When a ring fills up, spans are
+ * dropped and counted rather than waited for. */
+
+#define TRACE_RING_SIZE 8192
+
+/* How often the flusher wakes, in msec. */
+#define TRACE_FLUSH_INTERVAL 100
+
+struct span {
+    unsigned long long start, end;
+    const char *category;
+    const char *name;
+    int arg;
+};
+
+struct trace_ring {
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    unsigned long dropped;
+
+    struct span spans[TRACE_RING_SIZE];
+};
+
+struct trace {
+    FILE *f;
+    unsigned long long origin;
+    int first;
+
+    pthread_t thread;
+    atomic_int running;
+
+    struct trace_ring *rings[TRACE_RINGS];
+};
+
+unsigned long long trace_clock(struct dioxide *d) {
+    return d->trace ? event_clock() : 0;
+}
+
+/* Record a span from start until now on ring, which must belong to the
+ * calling thread. category and name must outlive the trace. */
+void trace_span(struct dioxide *d, unsigned ring, const char *category,
+                const char *name, int arg, unsigned long long start) {
+    struct trace_ring *r;
+    struct span *span;
+    unsigned head, tail;
+
+    if (!d->trace || !(r = d->trace->rings[ring])) {
+        return;
+    }
+
+    head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (head - tail == TRACE_RING_SIZE) {
+        r->dropped++;
+        return;
+    }
+
+    span = &r->spans[head & (TRACE_RING_SIZE - 1)];
+    span->start = start;
+    span->end = event_clock();
+    span->category = category;
+    span->name = name;
+    span->arg = arg;
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/* Write s as a JSON string, quotes and all; names can come from plugin
+ * labels, which may hold anything. */
+static void write_string(FILE *f, const char *s) {
+    unsigned char c;
+
+    fputc('"', f);
+
+    while ((c = *s++)) {
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+
+    fputc('"', f);
+}
+
+static void write_span(struct trace *t, unsigned ring, struct span *span) {
+    fprintf(t->f, "%s{\"name\":", t->first ? "" : ",\n");
+    write_string(t->f, span->name);
+    fprintf(t->f, ",\"cat\":");
+    write_string(t->f, span->category);
+    fprintf(t->f, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,"
+        "\"tid\":%u,\"args\":{\"value\":%d}}",
+        (span->start - t->origin) / 1000.0,
+        (span->end - span->start) / 1000.0, ring, span->arg);
+
+    t->first = 0;
+}
+
+static void write_thread_name(struct trace *t, unsigned ring,
+                              const char *name) {
+    fprintf(t->f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+        "\"tid\":%u,\"args\":{\"name\":", t->first ? "" : ",\n", ring);
+    write_string(t->f, name);
+    fprintf(t->f, "}}");
+
+    t->first = 0;
+}
+
+static void flush_trace(struct trace *t) {
+    struct trace_ring *r;
+    unsigned i, head, tail;
+
+    for (i = 0; i < TRACE_RINGS; i++) {
+        if (!(r = t->rings[i])) {
+            continue;
+        }
+
+        tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        for (; tail != head; tail++) {
+            write_span(t, i, &r->spans[tail & (TRACE_RING_SIZE - 1)]);
+        }
+
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+
+    fflush(t->f);
+}
+
+static void* flush(void *private) {
+    struct trace *t = private;
+    struct timespec interval = {
+        0, TRACE_FLUSH_INTERVAL * 1000000L,
+    };
+
+    while (atomic_load(&t->running)) {
+        nanosleep(&interval, NULL);
+        flush_trace(t);
+    }
+
+    return NULL;
+}
+
+/* Must be called before any thread that records spans is started, and
+ * with d->threads already set. */
+void setup_trace(struct dioxide *d, const char *path) {
+    struct trace *t;
+    char name[16];
+    unsigned i;
+    int retval;
+
+    t = calloc(1, sizeof(struct trace));
+
+    t->f = fopen(path, "w");
+    if (!t->f) {
+        printf("Couldn't open trace file %s\n", path);
+        free(t);
+        return;
+    }
+
+    for (i = 0; i <= d->threads && i < TRACE_SEQUENCER; i++) {
+        t->rings[i] = calloc(1, sizeof(struct trace_ring));
+    }
+    t->rings[TRACE_SEQUENCER] = calloc(1, sizeof(struct trace_ring));
+    if (d->pipelined) {
+        t->rings[TRACE_EFFECTS] = calloc(1, sizeof(struct trace_ring));
+    }
+
+    t->origin = event_clock();
+    t->first = 1;
+
+    fprintf(t->f, "[\n");
+    write_thread_name(t, 0, "audio");
+    for (i = 1; i <= d->threads && i < TRACE_SEQUENCER; i++) {
+        snprintf(name, sizeof(name), "worker %u", i);
+        write_thread_name(t, i, name);
+    }
+    write_thread_name(t, TRACE_SEQUENCER, "sequencer");
+    if (d->pipelined) {
+        write_thread_name(t, TRACE_EFFECTS, "effects");
+    }
+
+    atomic_store(&t->running, 1);
+
+    retval = pthread_create(&t->thread, NULL, flush, t);
+    if (retval) {
+        printf("Couldn't start trace thread: %s\n", strerror(retval));
+        exit(EXIT_FAILURE);
+    }
+
+    d->trace = t;
+
+    printf("Tracing to %s\n", path);
+}
+
+/* Must be called after every thread that records spans has stopped. */
+void cleanup_trace(struct dioxide *d) {
+    struct trace *t = d->trace;
+    unsigned long dropped = 0;
+    unsigned i;
+
+    if (!t) {
+        return;
+    }
+
+    atomic_store(&t->running, 0);
+    pthread_join(t->thread, NULL);
+
+    flush_trace(t);
+
+    fprintf(t->f, "\n]\n");
+    fclose(t->f);
+
+    for (i = 0; i < TRACE_RINGS; i++) {
+        if (t->rings[i]) {
+            dropped += t->rings[i]->dropped;
+            free(t->rings[i]);
+        }
+    }
+
+    if (dropped) {
+        printf("Trace dropped %lu spans; its rings were full\n", dropped);
+    }
+
+    free(t);
+    d->trace = NULL;
+}
@@ -1,103 +1,405 @@
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "dioxide.h"
 
-static struct lfo growlbrato = {
-    .rate = 80,
-    .center = 1,
-    /* six_cents - 1 */
-    .amplitude = 0.0034717485095028,
+/* Band-limited saw tables, one for every odd partial limit that
+ * generate_uranium() can pick. Fewer partials need fewer points, so the
+ * tables shrink as pitch rises, mipmap style. They're shared by every
+ * voice and built once. */
+#define MAX_PARTIALS 129
+#define SAW_TABLES ((MAX_PARTIALS + 1) / 2)
+#define MAX_TABLE_SIZE 2048
+
+struct wavetable {
+    /* 2^bits points, plus one repeating the first for interpolation. */
+    unsigned bits;
+    float *samples;
 };
 
-void generate_uranium(struct dioxide *d, struct note *note, float *buffer, unsigned size)
-{
-    double step, growl_adjustment, pitch, accumulator;
-    unsigned i, j, max_j;
+static struct wavetable saw_tables[SAW_TABLES];
+
+/* All of the tables, back to back, so that SIMD kernels can gather from
+ * several of them at once by offset. */
+static float *saw_pool;
+
+/* The growl: vibrato of six cents either way, fast while the note speaks
+ * and slow once it settles. */
+#define GROWL_DEPTH 0.0034717485095028
+#define GROWL_FAST 80
+#define GROWL_SLOW 5
+
+/* A group of voices rendered together, one per SIMD lane. Per-sample
+ * inputs are sample-major: entry i * lanes + lane. */
+struct lane_group {
+    unsigned lanes;
+
+    float *gains;
+    uint32_t *growl_steps;
+
+    int32_t offsets[VOICE_LANES];
+    unsigned bits[VOICE_LANES];
+    float scales[VOICE_LANES];
+    uint32_t steps[VOICE_LANES];
+    float float_steps[VOICE_LANES];
+};
+
+/* One per rendering thread. */
+static struct lane_group *groups;
+static unsigned group_count;
+
+typedef void (*group_func)(struct lane_group *group, struct voices *v,
+                           unsigned first, float *buffer, unsigned size);
+
+static group_func render_group;
+
+static struct wavetable* select_saw_table(struct dioxide *d, float pitch) {
+    unsigned max_j;
+
+    /* Weird things I've discovered.
+     * BLITs aren't necessary. This is strictly additive.
+     *
+     * If the number of additions is above 120 or so, stuff gets really
+     * shitty-sounding. The magic number of 129 should suffice for most
+     * things.
+     *
+     * If the number of additions is even, everything goes to shit. This
+     * helped: http://www.music.mcgill.ca/~gary/307/week5/bandlimited.html
+     */
+    max_j = d->rate / pitch / 3;
+    if (max_j > MAX_PARTIALS) {
+        max_j = MAX_PARTIALS;
+    } else if (!(max_j % 2)) {
+        /* Too high for any partials; go silent rather than wrapping. */
+        max_j = max_j ? max_j - 1 : 1;
+    }
+
+    return &saw_tables[max_j / 2];
+}
+
+static void render_group_scalar(struct lane_group *group,
+                                struct voices *v, unsigned first,
+                                float *buffer, unsigned size) {
+    float *table = saw_pool + group->offsets[0], growl;
+    uint32_t phase = v->phase[first], growl_phase = v->growl_phase[first];
+    uint32_t step = group->steps[0];
+    unsigned i, bits = group->bits[0];
 
     for (i = 0; i < size; i++) {
-        accumulator = 0;
+        growl_phase += group->growl_steps[i];
+        growl = GROWL_DEPTH * osc_sin(growl_phase);
 
-        d->metal->adsr(d, note);
+        buffer[i] += osc_lookup(table, bits, phase) * group->gains[i];
 
-        if (note->adsr_phase < ADSR_SUSTAIN) {
-            growlbrato.rate = 80;
-        } else {
-            growlbrato.rate = 5;
-        }
+        /* The growl bends the read rate by a few cents either way; only
+         * the offset from the base step needs converting. */
+        phase += step + (int32_t)(step * growl);
+    }
+
+    v->phase[first] = phase;
+    v->growl_phase[first] = growl_phase;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* The SIMD kernels run one voice per lane. Table positions are worked out
+ * in float from the top 31 bits of the phase, since the lanes' tables
+ * differ in size. */
+
+__attribute__((target("sse2")))
+static void render_group_sse2(struct lane_group *group,
+                              struct voices *v, unsigned first,
+                              float *buffer, unsigned size) {
+    __m128i phase, growl_phase, offsets, steps, index;
+    __m128 scales, float_steps, depth, growl, position, fraction, a, b, value;
+    int32_t indices[4];
+    unsigned i;
+
+    phase = _mm_loadu_si128((__m128i*)(v->phase + first));
+    growl_phase = _mm_loadu_si128((__m128i*)(v->growl_phase + first));
+    offsets = _mm_loadu_si128((__m128i*)group->offsets);
+    steps = _mm_loadu_si128((__m128i*)group->steps);
+    scales = _mm_loadu_ps(group->scales);
+    float_steps = _mm_loadu_ps(group->float_steps);
+    depth = _mm_set1_ps(GROWL_DEPTH);
+
+    for (i = 0; i < size; i++) {
+        growl_phase = _mm_add_epi32(growl_phase,
+            _mm_load_si128((__m128i*)(group->growl_steps + i * 4)));
+        growl = _mm_mul_ps(depth, osc_sin_sse2(growl_phase));
+
+        position = _mm_mul_ps(
+            _mm_cvtepi32_ps(_mm_srli_epi32(phase, 1)), scales);
+        index = _mm_cvttps_epi32(position);
+        fraction = _mm_sub_ps(position, _mm_cvtepi32_ps(index));
+        index = _mm_add_epi32(index, offsets);
+
+        /* No gathers before AVX2. */
+        _mm_storeu_si128((__m128i*)indices, index);
+        a = _mm_setr_ps(saw_pool[indices[0]], saw_pool[indices[1]],
+            saw_pool[indices[2]], saw_pool[indices[3]]);
+        b = _mm_setr_ps(saw_pool[indices[0] + 1], saw_pool[indices[1] + 1],
+            saw_pool[indices[2] + 1], saw_pool[indices[3] + 1]);
+
+        value = _mm_add_ps(a, _mm_mul_ps(fraction, _mm_sub_ps(b, a)));
+        value = _mm_mul_ps(value, _mm_load_ps(group->gains + i * 4));
+
+        value = _mm_add_ps(value, _mm_movehl_ps(value, value));
+        value = _mm_add_ss(value, _mm_shuffle_ps(value, value, 1));
+        buffer[i] += _mm_cvtss_f32(value);
+
+        phase = _mm_add_epi32(phase, _mm_add_epi32(steps,
+            _mm_cvttps_epi32(_mm_mul_ps(float_steps, growl))));
+    }
+
+    _mm_storeu_si128((__m128i*)(v->phase + first), phase);
+    _mm_storeu_si128((__m128i*)(v->growl_phase + first), growl_phase);
+}
+
+__attribute__((target("avx2")))
+static void render_group_avx2(struct lane_group *group,
+                              struct voices *v, unsigned first,
+                              float *buffer, unsigned size) {
+    __m256i phase, growl_phase, offsets, steps, index, one;
+    __m256 scales, float_steps, depth, growl, position, fraction, a, b, value;
+    __m128 sum;
+    unsigned i;
+
+    phase = _mm256_loadu_si256((__m256i*)(v->phase + first));
+    growl_phase = _mm256_loadu_si256((__m256i*)(v->growl_phase + first));
+    offsets = _mm256_loadu_si256((__m256i*)group->offsets);
+    steps = _mm256_loadu_si256((__m256i*)group->steps);
+    scales = _mm256_loadu_ps(group->scales);
+    float_steps = _mm256_loadu_ps(group->float_steps);
+    depth = _mm256_set1_ps(GROWL_DEPTH);
+    one = _mm256_set1_epi32(1);
+
+    for (i = 0; i < size; i++) {
+        growl_phase = _mm256_add_epi32(growl_phase,
+            _mm256_load_si256((__m256i*)(group->growl_steps + i * 8)));
+        growl = _mm256_mul_ps(depth, osc_sin_avx2(growl_phase));
+
+        position = _mm256_mul_ps(
+            _mm256_cvtepi32_ps(_mm256_srli_epi32(phase, 1)), scales);
+        index = _mm256_cvttps_epi32(position);
+        fraction = _mm256_sub_ps(position, _mm256_cvtepi32_ps(index));
+        index = _mm256_add_epi32(index, offsets);
+
+        a = _mm256_i32gather_ps(saw_pool, index, 4);
+        b = _mm256_i32gather_ps(saw_pool, _mm256_add_epi32(index, one), 4);
+
+        value = _mm256_add_ps(a, _mm256_mul_ps(fraction, _mm256_sub_ps(b, a)));
+        value = _mm256_mul_ps(value, _mm256_load_ps(group->gains + i * 8));
+
+        sum = _mm_add_ps(_mm256_castps256_ps128(value),
+            _mm256_extractf128_ps(value, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        buffer[i] += _mm_cvtss_f32(sum);
+
+        phase = _mm256_add_epi32(phase, _mm256_add_epi32(steps,
+            _mm256_cvttps_epi32(_mm256_mul_ps(float_steps, growl))));
+    }
+
+    _mm256_storeu_si256((__m256i*)(v->phase + first), phase);
+    _mm256_storeu_si256((__m256i*)(v->growl_phase + first), growl_phase);
+}
+#endif
+
+static void* alloc_group(size_t size) {
+    void *p;
+
+    if (posix_memalign(&p, 32, size)) {
+        printf("Couldn't allocate uranium scratch\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return p;
+}
+
+void setup_uranium(struct dioxide *d) {
+    double *saw;
+    unsigned i, j, max_j, bits, size, stride, offset, total = 0;
+    struct wavetable *table;
+    unsigned lanes;
 
-        pitch = note->pitch * step_lfo(d, &growlbrato, 1);
-
-        step = 2 * M_PI * pitch * d->inverse_sample_rate;
-
-        /* Weird things I've discovered.
-         * BLITs aren't necessary. This is strictly additive.
-         *
-         * If the number of additions is above 120 or so, stuff gets really
-         * shitty-sounding. The magic number of 129 should suffice for most
-         * things.
-         *
-         * If the number of additions is even, everything goes to shit. This
-         * helped: http://www.music.mcgill.ca/~gary/307/week5/bandlimited.html
-         */
-        max_j = d->spec.freq / note->pitch / 3;
-        if (max_j > 129) {
-            max_j = 129;
-        } else if (!(max_j % 2)) {
-            max_j--;
+    switch (d->simd) {
+#if defined(__x86_64__) || defined(__i386__)
+        case SIMD_AVX2:
+            lanes = 8;
+            render_group = render_group_avx2;
+            break;
+        case SIMD_SSE2:
+            lanes = 4;
+            render_group = render_group_sse2;
+            break;
+#endif
+        default:
+            lanes = 1;
+            render_group = render_group_scalar;
+            break;
+    }
+
+    /* The audio thread and every worker get their own scratch. */
+    group_count = d->threads + 1;
+    groups = calloc(group_count, sizeof(struct lane_group));
+
+    for (i = 0; i < group_count; i++) {
+        groups[i].lanes = lanes;
+        groups[i].gains =
+            alloc_group(d->samples * lanes * sizeof(float));
+        groups[i].growl_steps =
+            alloc_group(d->samples * lanes * sizeof(uint32_t));
+    }
+
+    if (saw_pool) {
+        return;
+    }
+
+    /* At least 16 points per cycle of the highest partial. */
+    for (max_j = 1; max_j <= MAX_PARTIALS; max_j += 2) {
+        bits = 6;
+        while ((1 << bits) < max_j * 16 && (1 << bits) < MAX_TABLE_SIZE) {
+            bits++;
         }
 
-        for (j = 1; j < max_j; j++) {
-            accumulator += sin(note->phase * j) / j;
+        saw_tables[max_j / 2].bits = bits;
+        total += (1 << bits) + 1;
+    }
+
+    /* One spare point past the end, for reads past a guard point. */
+    saw_pool = calloc(total + 1, sizeof(float));
+    saw = calloc(MAX_TABLE_SIZE, sizeof(double));
+
+    /* Table k holds the saw summed up to, but not including, partial
+     * max_j = 2k + 1; build them all from one running sum. */
+    for (max_j = 1, j = 1, offset = 0; max_j <= MAX_PARTIALS; max_j += 2) {
+        for (; j < max_j; j++) {
+            for (i = 0; i < MAX_TABLE_SIZE; i++) {
+                saw[i] += sin(2 * M_PI * i * j / MAX_TABLE_SIZE) / j;
+            }
         }
 
-        note->phase += step;
+        table = &saw_tables[max_j / 2];
+        size = 1 << table->bits;
+        stride = MAX_TABLE_SIZE / size;
+
+        table->samples = saw_pool + offset;
+        offset += size + 1;
 
-        while (note->phase > 2 * M_PI) {
-            note->phase -= 2 * M_PI;
+        for (i = 0; i < size; i++) {
+            table->samples[i] = saw[i * stride];
         }
+        table->samples[size] = table->samples[0];
+    }
+
+    free(saw);
+}
 
-        *buffer += accumulator * note->adsr_volume;
-        buffer++;
+void cleanup_uranium(struct dioxide *d) {
+    unsigned i;
+
+    for (i = 0; i < group_count; i++) {
+        free(groups[i].gains);
+        free(groups[i].growl_steps);
     }
+
+    free(groups);
+    free(saw_pool);
+
+    groups = NULL;
+    group_count = 0;
+    saw_pool = NULL;
 }
 
-void adsr_uranium(struct dioxide *d, struct note *note) {
-    static float peak = 1.0, sustain = 0.4;
-    switch (note->adsr_phase) {
-        case ADSR_ATTACK:
-            if (note->adsr_volume < peak) {
-                note->adsr_volume += d->inverse_sample_rate / d->attack_time;
-            } else {
-                note->adsr_volume = peak;
-                note->adsr_phase = ADSR_DECAY;
-            }
-            break;
-        case ADSR_DECAY:
-            if (note->adsr_volume > sustain) {
-                note->adsr_volume -= (peak - sustain) * d->inverse_sample_rate
-                    / d->decay_time;
-            } else {
-                note->adsr_volume = sustain;
-                note->adsr_phase = ADSR_SUSTAIN;
+/* Work out everything per-lane and per-sample that the kernels need,
+ * stepping the envelopes as we go. Lanes past the last voice, or holding a
+ * voice started on another element, are silent. */
+static void prepare_group(struct lane_group *group, struct dioxide *d,
+                          struct voices *v, unsigned first, unsigned last,
+                          unsigned size) {
+    struct wavetable *table;
+    uint32_t fast, slow;
+    unsigned i, lane, voice, speaking, lanes = group->lanes;
+
+    fast = osc_step(GROWL_FAST, d->inverse_sample_rate);
+    slow = osc_step(GROWL_SLOW, d->inverse_sample_rate);
+
+    for (lane = 0; lane < lanes; lane++) {
+        voice = first + lane;
+
+        if (voice >= last || v->element[voice] != &uranium) {
+            group->offsets[lane] = saw_tables[0].samples - saw_pool;
+            group->bits[lane] = saw_tables[0].bits;
+            group->scales[lane] = 0;
+            group->steps[lane] = 0;
+            group->float_steps[lane] = 0;
+
+            for (i = 0; i < size; i++) {
+                group->gains[i * lanes + lane] = 0;
+                group->growl_steps[i * lanes + lane] = 0;
             }
-            break;
-        case ADSR_SUSTAIN:
-            break;
-        case ADSR_RELEASE:
-            if (note->adsr_volume > 0.0) {
-                note->adsr_volume -= sustain * d->inverse_sample_rate
-                    / d->release_time;
-            } else {
-                note->adsr_volume = 0.0;
+
+            continue;
+        }
+
+        /* Pitch only changes between buffers, so neither does the table. */
+        table = select_saw_table(d, v->pitch[voice]);
+
+        group->offsets[lane] = table->samples - saw_pool;
+        group->bits[lane] = table->bits;
+        group->scales[lane] = ldexpf(1, table->bits - 31);
+        group->steps[lane] = osc_step(v->pitch[voice], d->inverse_sample_rate);
+        group->float_steps[lane] = group->steps[lane];
+
+        speaking = step_envelope(d, v, voice, group->gains + lane, lanes,
+            size);
+
+        /* Growl fast while the note speaks, slowly once it settles. */
+        for (i = 0; i < size; i++) {
+            group->growl_steps[i * lanes + lane] = i < speaking ? fast : slow;
+        }
+    }
+}
+
+/* Voices are taken a group of lanes at a time, starting from first, which
+ * is always a multiple of VOICE_LANES; lanes at or past last are silent, so
+ * threads rendering neighbouring ranges never share a group. */
+void generate_uranium(struct dioxide *d, struct voices *v, unsigned first,
+                      unsigned last, float *buffer, unsigned size,
+                      unsigned thread) {
+    struct lane_group *group = &groups[thread];
+    unsigned voice, end;
+
+    for (; first < last; first += group->lanes) {
+        end = first + group->lanes < last ? first + group->lanes : last;
+
+        /* Skip groups that are all still ringing out on titanium. */
+        for (voice = first; voice < end; voice++) {
+            if (v->element[voice] == &uranium) {
+                break;
             }
-            break;
-        default:
-            break;
+        }
+        if (voice == end) {
+            continue;
+        }
+
+        prepare_group(group, d, v, first, last, size);
+        render_group(group, v, first, buffer, size);
     }
 }
 
+/* Lookups cost the same at any pitch, since the tables are shared; it's the
+ * gathers that count. */
+float cost_uranium(struct dioxide *d, struct voices *v, unsigned voice) {
+    return 3.0;
+}
+
 struct element uranium = {
+    "uranium",
+    NULL,
     generate_uranium,
-    adsr_uranium,
+    cost_uranium,
+    1.0,
+    0.4,
 };
@@ -0,0 +1,185 @@
+#include <stdlib.h>
+
+#include "dioxide.h"
+
+static void* alloc_lanes(unsigned count, size_t size) {
+    void *p;
+
+    /* Aligned for the widest SIMD loads. */
+    if (posix_memalign(&p, 32, count * size)) {
+        printf("Couldn't allocate voices\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(p, 0, count * size);
+
+    return p;
+}
+
+void setup_voices(struct dioxide *d) {
+    struct voices *v = &d->voices;
+    unsigned capacity;
+
+    if (!d->max_voices || d->max_voices > MAX_VOICES) {
+        d->max_voices = MAX_VOICES;
+    }
+
+    /* Pad so that the last group of lanes is always addressable. */
+    capacity = (d->max_voices + VOICE_LANES - 1) / VOICE_LANES * VOICE_LANES;
+
+    v->capacity = capacity;
+
+    v->note = alloc_lanes(capacity, sizeof(unsigned));
+    v->pitch = alloc_lanes(capacity, sizeof(float));
+    v->phase = alloc_lanes(capacity, sizeof(uint32_t));
+    v->growl_phase = alloc_lanes(capacity, sizeof(uint32_t));
+    v->element = alloc_lanes(capacity, sizeof(struct element*));
+    v->adsr_phase = alloc_lanes(capacity, sizeof(enum adsr));
+    v->adsr_volume = alloc_lanes(capacity, sizeof(float));
+
+    clear_voices(d);
+}
+
+void cleanup_voices(struct dioxide *d) {
+    struct voices *v = &d->voices;
+
+    free(v->note);
+    free(v->pitch);
+    free(v->phase);
+    free(v->growl_phase);
+    free(v->element);
+    free(v->adsr_phase);
+    free(v->adsr_volume);
+
+    memset(v, 0, sizeof(struct voices));
+}
+
+void clear_voices(struct dioxide *d) {
+    struct voices *v = &d->voices;
+    unsigned i;
+
+    v->count = 0;
+
+    for (i = 0; i < MIDI_NOTES; i++) {
+        v->index[i] = -1;
+    }
+}
+
+/* With the pool full, take over the quietest voice, preferring ones that
+ * are already on their way out. */
+static unsigned steal_voice(struct voices *v) {
+    unsigned i, victim = 0;
+    int released, victim_released = 0;
+
+    for (i = 0; i < v->count; i++) {
+        released = v->adsr_phase[i] == ADSR_RELEASE;
+
+        if (released > victim_released ||
+            (released == victim_released &&
+             v->adsr_volume[i] < v->adsr_volume[victim])) {
+            victim = i;
+            victim_released = released;
+        }
+    }
+
+    v->index[v->note[victim]] = -1;
+
+    return victim;
+}
+
+void voice_on(struct dioxide *d, unsigned note) {
+    struct voices *v = &d->voices;
+    int i;
+
+    if (note >= MIDI_NOTES) {
+        return;
+    }
+
+    i = v->index[note];
+
+    /* A repeated note retriggers its voice, keeping the phase. Either way,
+     * the voice plays on the current element until it's reaped. */
+    if (i < 0) {
+        if (v->count < d->max_voices) {
+            i = v->count++;
+        } else {
+            i = steal_voice(v);
+        }
+
+        v->index[note] = i;
+
+        v->note[i] = note;
+        v->pitch[i] = 0;
+        v->phase[i] = 0;
+        v->growl_phase[i] = 0;
+    }
+
+    v->element[i] = d->metal;
+    v->adsr_phase[i] = ADSR_ATTACK;
+    v->adsr_volume[i] = 0.0;
+}
+
+void voice_off(struct dioxide *d, unsigned note) {
+    struct voices *v = &d->voices;
+
+    if (note < MIDI_NOTES && v->index[note] >= 0) {
+        v->adsr_phase[v->index[note]] = ADSR_RELEASE;
+    }
+}
+
+/* Drop voices whose release has finished, moving the last voice into each
+ * hole so that the live ones stay packed. */
+void reap_voices(struct dioxide *d) {
+    struct voices *v = &d->voices;
+    unsigned i = 0, last;
+
+    while (i < v->count) {
+        if (v->adsr_volume[i] == 0.0 && v->adsr_phase[i] == ADSR_RELEASE) {
+            last = --v->count;
+
+            v->index[v->note[i]] = -1;
+
+            if (i != last) {
+                v->note[i] = v->note[last];
+                v->pitch[i] = v->pitch[last];
+                v->phase[i] = v->phase[last];
+                v->growl_phase[i] = v->growl_phase[last];
+                v->element[i] = v->element[last];
+                v->adsr_phase[i] = v->adsr_phase[last];
+                v->adsr_volume[i] = v->adsr_volume[last];
+
+                v->index[v->note[i]] = i;
+            }
+        } else {
+            i++;
+        }
+    }
+}
+
+enum simd detect_simd(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return SIMD_SSE2;
+    }
+#endif
+
+    return SIMD_SCALAR;
+}
+
+const char* simd_name(enum simd simd) {
+    switch (simd) {
+        case SIMD_SCALAR:
+            return "scalar";
+        case SIMD_SSE2:
+            return "SSE2";
+        case SIMD_AVX2:
+            return "AVX2";
+        default:
+            return "auto";
+    }
+}
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "dioxide.h"
+
+/* An optional pool of pinned threads that render voices alongside the audio
+ * thread, and run whatever else can be split up, such as parallel branches
+ * of the effects. Voices are cut into chunks of VOICE_LANES, so that no two
+ * threads ever share a SIMD group; the chunks are sorted by estimated cost,
+ * heaviest first, and every thread takes the next one off a shared counter
+ * until none are left, so a thread that finishes early steals work from
+ * the rest. Each thread mixes into its own buffer, and the audio thread
+ * sums them.
+ *
+ * Workers spin for SPIN_NS after each job and then sleep on a futex, as
+ * does the audio thread waiting for a job to finish; either side only
+ * makes a system call to wake the other if it's actually asleep. Nothing
+ * on the hot path takes a lock. */
+
+#define CHUNKS (MAX_VOICES / VOICE_LANES)
+
+struct chunk {
+    unsigned first, last;
+    float cost;
+};
+
+struct worker {
+    struct dioxide *d;
+    pthread_t thread;
+    unsigned id;
+
+    /* 32-byte aligned, one buffer long. */
+    float *buffer;
+    /* Whether buffer holds anything from the last job. */
+    int used;
+};
+
+struct workers {
+    unsigned count;
+    struct worker *workers;
+
+    /* Bumped once per job; workers wait for it to change. */
+    _Alignas(64) atomic_uint generation;
+    /* Next chunk to take. */
+    _Alignas(64) atomic_uint next;
+    /* Workers still on the current job, and whether the audio thread is
+     * asleep waiting for them. */
+    _Alignas(64) atomic_uint pending;
+    atomic_int finishing;
+    atomic_uint sleepers;
+    atomic_int quit;
+
+    /* The current job, written only between jobs: either tasks, if task is
+     * set, or else chunks of voices. */
+    unsigned len;
+    unsigned chunks;
+    struct chunk chunk[CHUNKS];
+
+    task_fn task;
+    void *data;
+    unsigned tasks;
+};
+
+void futex_wait(atomic_uint *word, unsigned value) {
+    syscall(SYS_futex, (unsigned*)word, FUTEX_WAIT_PRIVATE, value,
+        NULL, NULL, 0);
+}
+
+void futex_wake(atomic_uint *word) {
+    syscall(SYS_futex, (unsigned*)word, FUTEX_WAKE_PRIVATE, MAX_THREADS,
+        NULL, NULL, 0);
+}
+
+/* Take chunks until there are none left, mixing them into buffer. Returns
+ * nonzero if any were taken. */
+static int take_chunks(struct dioxide *d, struct workers *w, float *buffer,
+                       unsigned thread, int clear) {
+    struct chunk *chunk;
+    unsigned i;
+    int taken = 0;
+
+    while ((i = atomic_fetch_add_explicit(&w->next, 1,
+                memory_order_relaxed)) < w->chunks) {
+        chunk = &w->chunk[i];
+
+        if (clear && !taken) {
+            memset(buffer, 0, w->len * sizeof(float));
+        }
+        taken = 1;
+
+        generate_voices(d, chunk->first, chunk->last, buffer, w->len, thread);
+    }
+
+    return taken;
+}
+
+/* Run tasks until there are none left. */
+static void take_tasks(struct dioxide *d, struct workers *w, unsigned thread) {
+    unsigned i;
+
+    while ((i = atomic_fetch_add_explicit(&w->next, 1,
+                memory_order_relaxed)) < w->tasks) {
+        w->task(d, w->data, i, w->len, thread);
+    }
+}
+
+static void* work(void *private) {
+    struct worker *worker = private;
+    struct dioxide *d = worker->d;
+    struct workers *w = d->workers;
+    unsigned seen = 0, generation;
+    struct spin spin;
+
+    make_realtime(d, "worker", -1);
+
+    for (;;) {
+        start_spin(&spin);
+
+        while ((generation = atomic_load_explicit(&w->generation,
+                    memory_order_acquire)) == seen) {
+            if (spinning(&spin)) {
+                continue;
+            }
+
+            /* Paired with the audio thread bumping generation and then
+             * checking sleepers; one of the two always sees the other. */
+            atomic_fetch_add(&w->sleepers, 1);
+            futex_wait(&w->generation, seen);
+            atomic_fetch_sub(&w->sleepers, 1);
+        }
+
+        seen = generation;
+
+        if (atomic_load_explicit(&w->quit, memory_order_relaxed)) {
+            break;
+        }
+
+        if (w->task) {
+            take_tasks(d, w, worker->id);
+            worker->used = 0;
+        } else {
+            worker->used = take_chunks(d, w, worker->buffer, worker->id, 1);
+        }
+
+        /* Sequentially consistent, for the finishing check; the last one
+         * off the job wakes the audio thread if it gave up spinning. */
+        if (atomic_fetch_sub(&w->pending, 1) == 1 &&
+            atomic_load(&w->finishing)) {
+            futex_wake(&w->pending);
+        }
+    }
+
+    return NULL;
+}
+
+static void pin(pthread_t thread, unsigned cpu) {
+    cpu_set_t set;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int retval;
+
+    if (cpus < 1) {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu % cpus, &set);
+
+    retval = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set);
+    if (retval) {
+        printf("Couldn't pin worker to CPU %u: %s\n", cpu % (unsigned)cpus,
+            strerror(retval));
+    }
+}
+
+void setup_workers(struct dioxide *d) {
+    struct workers *w;
+    struct worker *worker;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned i;
+    int retval;
+
+    d->workers = NULL;
+
+    /* Spinning workers are worse than useless without cores to spin on. */
+    if (cpus > 0 && d->threads >= cpus) {
+        printf("Only %ld CPUs; limiting voice rendering to %ld workers\n",
+            cpus, cpus - 1);
+        d->threads = cpus - 1;
+    }
+
+    if (!d->threads) {
+        return;
+    }
+
+    w = calloc(1, sizeof(struct workers));
+    w->workers = calloc(d->threads, sizeof(struct worker));
+    d->workers = w;
+
+    for (i = 0; i < d->threads; i++) {
+        worker = &w->workers[i];
+        worker->d = d;
+        /* Scratch 0 belongs to the audio thread. */
+        worker->id = i + 1;
+
+        if (posix_memalign((void**)&worker->buffer, 32,
+                d->samples * sizeof(float))) {
+            printf("Couldn't allocate worker buffers\n");
+            exit(EXIT_FAILURE);
+        }
+
+        retval = pthread_create(&worker->thread, NULL, work, worker);
+        if (retval) {
+            printf("Couldn't start worker %u: %s\n", i, strerror(retval));
+            free(worker->buffer);
+            break;
+        }
+
+        /* Keep off the audio thread's CPU, which is usually 0. */
+        pin(worker->thread, (d->rt_cpu > 0 ? d->rt_cpu : 0) + i + 1);
+
+        w->count++;
+    }
+
+    printf("Rendering voices on %u worker threads\n", w->count);
+}
+
+void cleanup_workers(struct dioxide *d) {
+    struct workers *w = d->workers;
+    unsigned i;
+
+    if (!w) {
+        return;
+    }
+
+    atomic_store(&w->quit, 1);
+    atomic_fetch_add(&w->generation, 1);
+    futex_wake(&w->generation);
+
+    for (i = 0; i < w->count; i++) {
+        pthread_join(w->workers[i].thread, NULL);
+        free(w->workers[i].buffer);
+    }
+
+    free(w->workers);
+    free(w);
+    d->workers = NULL;
+}
+
+/* Cut the voices into chunks and sort them, heaviest first, so that the
+ * big ones are taken early and the stragglers at the end are small. */
+static void plan_chunks(struct dioxide *d, struct workers *w) {
+    struct voices *v = &d->voices;
+    struct chunk chunk;
+    unsigned i, j;
+
+    w->chunks = 0;
+
+    for (i = 0; i < v->count; i += VOICE_LANES) {
+        chunk.first = i;
+        chunk.last = i + VOICE_LANES < v->count ? i + VOICE_LANES : v->count;
+        chunk.cost = 0;
+
+        for (j = chunk.first; j < chunk.last; j++) {
+            chunk.cost += v->element[j]->cost(d, v, j);
+        }
+
+        /* Insertion sort; there are at most CHUNKS of them. */
+        for (j = w->chunks; j && w->chunk[j - 1].cost < chunk.cost; j--) {
+            w->chunk[j] = w->chunk[j - 1];
+        }
+        w->chunk[j] = chunk;
+        w->chunks++;
+    }
+}
+
+static void start_job(struct workers *w, unsigned len) {
+    w->len = len;
+    atomic_store_explicit(&w->next, 0, memory_order_relaxed);
+    atomic_store_explicit(&w->pending, w->count, memory_order_relaxed);
+
+    /* Publishes the job; sequentially consistent, for the sleepers check. */
+    atomic_fetch_add(&w->generation, 1);
+
+    if (atomic_load(&w->sleepers)) {
+        futex_wake(&w->generation);
+    }
+}
+
+static void finish_job(struct workers *w) {
+    unsigned pending;
+    struct spin spin;
+
+    start_spin(&spin);
+
+    /* Waiting only for work already under way, so this is short, unless a
+     * worker was preempted; then sleep rather than starve it, should it be
+     * on this CPU at the same priority. */
+    while ((pending = atomic_load_explicit(&w->pending,
+                memory_order_acquire))) {
+        if (spinning(&spin)) {
+            continue;
+        }
+
+        /* Paired with the last worker dropping pending and then checking
+         * finishing. */
+        atomic_store(&w->finishing, 1);
+        if (atomic_load(&w->pending) == pending) {
+            futex_wait(&w->pending, pending);
+        }
+        atomic_store(&w->finishing, 0);
+    }
+}
+
+/* Add every voice into buffer, spreading the work over the pool if there's
+ * enough of it to go around. */
+void render_voices(struct dioxide *d, float *buffer, unsigned len) {
+    struct workers *w = d->workers;
+    struct worker *worker;
+    unsigned i, j;
+
+    if (!w || !w->count || d->voices.count <= VOICE_LANES) {
+        generate_voices(d, 0, d->voices.count, buffer, len, 0);
+        return;
+    }
+
+    plan_chunks(d, w);
+
+    w->task = NULL;
+    start_job(w, len);
+
+    /* Pitch in, straight into the output. */
+    take_chunks(d, w, buffer, 0, 0);
+
+    finish_job(w);
+
+    for (i = 0; i < w->count; i++) {
+        worker = &w->workers[i];
+
+        if (!worker->used) {
+            continue;
+        }
+
+        for (j = 0; j < len; j++) {
+            buffer[j] += worker->buffer[j];
+        }
+    }
+}
+
+/* Run task(d, data, i, len, thread) for every i below count, spread over
+ * the audio thread and the pool, and return once all of them have. */
+void run_tasks(struct dioxide *d, task_fn task, void *data, unsigned count,
+               unsigned len) {
+    struct workers *w = d->workers;
+    unsigned i;
+
+    if (!w || !w->count) {
+        for (i = 0; i < count; i++) {
+            task(d, data, i, len, 0);
+        }
+        return;
+    }
+
+    w->task = task;
+    w->data = data;
+    w->tasks = count;
+    start_job(w, len);
+
+    take_tasks(d, w, 0);
+
+    finish_job(w);
+}